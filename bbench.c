@@ -0,0 +1,159 @@
+/*
+ * bbench - per-object cost of mm_malloc_batch and mm_free_batch
+ *
+ * Each pattern allocates a group of n blocks of one size, writes to
+ * every block, and frees the group again, over and over: once with n
+ * calls to mm_malloc and mm_free, once with one call to each batch
+ * function, and once with the C library for reference.  Groups of
+ * heap blocks are also freed in a shuffled order, as a parser freeing
+ * its nodes would, which the batch free sorts back by address.
+ *
+ * usage: bbench [-s scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_GROUP	1024
+#define OBJECTS		4000000		/* blocks allocated per pattern and method */
+
+struct pattern {
+	size_t size;       /* bytes per block */
+	size_t group;      /* blocks allocated and freed together */
+};
+
+static struct pattern patterns[] = {
+	{   32,   16 },
+	{   32,  256 },
+	{  128,   64 },
+	{  512,   64 },
+	{  512, 1024 },
+	{ 2048,   64 },
+	{ 4096,   64 },
+	{ 16384,  16 },
+};
+
+static int scale = 1;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* shuffle the order blocks are freed in */
+static void shuffle(void** ptrs, size_t n, unsigned int* seed)
+{
+	for (size_t i = n - 1; i > 0; i--) {
+		*seed = *seed * 1103515245 + 12345;
+		size_t j = (*seed >> 8) % (i + 1);
+		void* t = ptrs[i];
+		ptrs[i] = ptrs[j];
+		ptrs[j] = t;
+	}
+}
+
+static void touch(void** ptrs, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		*(char*)ptrs[i] = (char)i;
+}
+
+static void fail(const char* what)
+{
+	fprintf(stderr, "bbench: %s failed\n", what);
+	exit(1);
+}
+
+/* returns nanoseconds per block allocated and freed */
+static double run_single(struct pattern* p, int mixed, int lib)
+{
+	void* ptrs[MAX_GROUP];
+	unsigned int seed = 1;
+	size_t rounds = OBJECTS * scale / p->group;
+
+	double begin = now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < p->group; i++)
+			if (!(ptrs[i] = lib ? malloc(p->size) : mm_malloc(p->size)))
+				fail("malloc");
+		touch(ptrs, p->group);
+		if (mixed)
+			shuffle(ptrs, p->group, &seed);
+		for (size_t i = 0; i < p->group; i++) {
+			if (lib)
+				free(ptrs[i]);
+			else
+				mm_free(ptrs[i]);
+		}
+	}
+	return (now() - begin) * 1e9 / (rounds * p->group);
+}
+
+static double run_batch(struct pattern* p, int mixed)
+{
+	void* ptrs[MAX_GROUP];
+	unsigned int seed = 1;
+	size_t rounds = OBJECTS * scale / p->group;
+
+	double begin = now();
+	for (size_t r = 0; r < rounds; r++) {
+		if (mm_malloc_batch(p->size, p->group, ptrs) != p->group)
+			fail("mm_malloc_batch");
+		touch(ptrs, p->group);
+		if (mixed)
+			shuffle(ptrs, p->group, &seed);
+		mm_free_batch(ptrs, p->group);
+	}
+	return (now() - begin) * 1e9 / (rounds * p->group);
+}
+
+int main(int argc, char** argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:h")) != -1) {
+		switch (c) {
+		case 's':
+			scale = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bbench [-s scale]\n");
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+	if (scale < 1)
+		scale = 1;
+
+	mem_init();
+	if (mm_init() < 0)
+		fail("mm_init");
+
+	printf("ns per block allocated and freed\n");
+	printf("%6s %6s %8s %10s %9s %8s %10s %9s %8s\n", "size", "group",
+	       "mm", "mm batch", "libc", "mixed mm", "mixed batch", "mixed libc", "speedup");
+
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		struct pattern* p = &patterns[i];
+		double single = run_single(p, 0, 0);
+		double batch = run_batch(p, 0);
+		double lib = run_single(p, 0, 1);
+		double mixedSingle = run_single(p, 1, 0);
+		double mixedBatch = run_batch(p, 1);
+		double mixedLib = run_single(p, 1, 1);
+
+		printf("%6zu %6zu %8.1f %10.1f %9.1f %8.1f %10.1f %9.1f %8.2f\n", p->size, p->group,
+		       single, batch, lib, mixedSingle, mixedBatch, mixedLib, single / batch);
+	}
+
+	if (!mm_check())
+		fail("mm_check");
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * clock.c - Routines for using the cycle counters on x86 and ARMv8.
+ *
+ * On other machines the counter falls back to a monotonic clock
+ * counting nanoseconds, which mhz() then reports as a 1000 MHz clock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/times.h>
+#include "clock.h"
+
+
+/*******************************************************
+ * Machine dependent functions
+ *
+ * Note: the constants __i386__, __x86_64__ and __aarch64__
+ * are set by GCC when it calls the C preprocessor.
+ *******************************************************/
+
+static uint64_t cyc_start;
+
+static uint64_t access_counter(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned hi, lo;
+    asm volatile("rdtsc; movl %%edx,%0; movl %%eax,%1"
+                 : "=r" (hi), "=r" (lo)
+                 : /* No input */
+                 : "%edx", "%eax");
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t counter;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r" (counter));
+    return counter;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Record the current value of the cycle counter. */
+void start_counter()
+{
+    cyc_start = access_counter();
+}
+
+/* Return the number of cycles since the last call to start_counter. */
+double get_counter()
+{
+    return (double)(access_counter() - cyc_start);
+}
+
+/* Measure overhead for counter */
+double ovhd()
+{
+    /* Do it twice to eliminate cache effects */
+    int i;
+    double result = 0;
+
+    for (i = 0; i < 2; i++) {
+        start_counter();
+        result = get_counter();
+    }
+    return result;
+}
+
+/* Estimate the clock rate by measuring the cycles that elapse */
+/* while sleeping for sleeptime seconds */
+double mhz_full(int verbose, int sleeptime)
+{
+    double rate;
+
+    start_counter();
+    sleep(sleeptime);
+    rate = get_counter() / (1e6 * sleeptime);
+    if (verbose)
+        printf("Processor clock rate ~= %.1f MHz\n", rate);
+    return rate;
+}
+
+/* Version using a default sleeptime */
+double mhz(int verbose)
+{
+    return mhz_full(verbose, 2);
+}
+
+/** Special counters that compensate for timer interrupt overhead */
+
+static double cyc_per_tick = 0.0;
+
+#define NEVENT 100
+#define THRESHOLD 1000
+#define RECORDTHRESH 3000
+
+/* Attempt to see how much time is used by timer interrupt */
+static void callibrate(int verbose)
+{
+    double oldt;
+    struct tms t;
+    clock_t oldc;
+    int e = 0;
+
+    times(&t);
+    oldc = t.tms_utime;
+    start_counter();
+    oldt = get_counter();
+    while (e < NEVENT) {
+        double newt = get_counter();
+
+        if (newt - oldt >= THRESHOLD) {
+            clock_t newc;
+            times(&t);
+            newc = t.tms_utime;
+            if (newc > oldc) {
+                double cpt = (newt - oldt) / (newc - oldc);
+                if ((cyc_per_tick == 0.0 || cyc_per_tick > cpt) && cpt > RECORDTHRESH)
+                    cyc_per_tick = cpt;
+                e++;
+                oldc = newc;
+            }
+            oldt = newt;
+        }
+    }
+    if (verbose)
+        printf("Setting cyc_per_tick to %f\n", cyc_per_tick);
+}
+
+static clock_t start_tick = 0;
+
+void start_comp_counter()
+{
+    struct tms t;
+
+    if (cyc_per_tick == 0.0)
+        callibrate(0);
+    times(&t);
+    start_tick = t.tms_utime;
+    start_counter();
+}
+
+double get_comp_counter()
+{
+    double time = get_counter();
+    double ctime;
+    struct tms t;
+    clock_t ticks;
+
+    times(&t);
+    ticks = t.tms_utime - start_tick;
+    ctime = time - ticks * cyc_per_tick;
+    return ctime;
+}
@@ -0,0 +1,68 @@
+#ifndef __CONFIG_H_
+#define __CONFIG_H_
+
+/*
+ * config.h - malloc driver configuration file
+ */
+
+/*
+ * This is the default path where the driver will look for the
+ * default tracefiles. You can override it at runtime with the -t flag.
+ */
+#define TRACEDIR "./traces/"
+
+/*
+ * This is the list of default tracefiles in TRACEDIR that the driver
+ * will use for testing. Modify this if you want to add or delete
+ * traces from the driver's test suite.
+ */
+#define DEFAULT_TRACEFILES \
+  "short1-bal.rep",\
+  "short2-bal.rep",\
+  "binary-bal.rep",\
+  "binary2-bal.rep",\
+  "coalescing-bal.rep",\
+  "random-bal.rep",\
+  "random2-bal.rep",\
+  "churn-bal.rep",\
+  "phase-bal.rep",\
+  "realloc-bal.rep",\
+  "realloc2-bal.rep"
+
+/*
+ * This constant gives the estimated performance of the libc malloc
+ * package using our traces on some reference system, typically the
+ * same kind of system the students use. Its purpose is to cap the
+ * contribution of throughput to the performance index. Once the
+ * students surpass the AVG_LIBC_THRUPUT, they get no further benefit
+ * to their score.  This deters students from building extremely fast,
+ * but extremely stupid malloc packages.
+ */
+#define AVG_LIBC_THRUPUT      60E6  /* 60 Mops/sec */
+
+ /*
+  * This constant determines the contributions of space utilization
+  * (UTIL_WEIGHT) and throughput (1 - UTIL_WEIGHT) to the performance
+  * index.
+  */
+#define UTIL_WEIGHT .60
+
+/*
+ * Alignment requirement in bytes (either 8 or 16)
+ */
+#define ALIGNMENT 16
+
+/*
+ * Maximum heap size in bytes.  The simulated heap is reserved up
+ * front but only the pages the allocator touches take up memory.
+ */
+#define MAX_HEAP (1UL << 30)  /* 1 GiB */
+
+/*****************************************************************************
+ * Set exactly one of these USE_xxx constants to "1" to select a timing method
+ *****************************************************************************/
+#define USE_FCYC   1   /* cycle counter w/ K-best scheme (x86 & Alpha only) */
+#define USE_ITIMER 0   /* interval timer (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+
+#endif /* __CONFIG_H */
@@ -0,0 +1,209 @@
+/*
+ * cxxbench - std containers on mm::allocator and mm::memory_resource
+ *
+ * Each workload runs once with std::allocator (the C library malloc),
+ * once with mm::allocator<T> and once with std::pmr containers on
+ * mm::get_memory_resource(), and reports nanoseconds per operation:
+ *
+ *   vector grow   push_back into vectors of up to 4096 elements, so
+ *                 the buffer is reallocated as it doubles
+ *   vector small  build and drop many vectors of 1 to 64 elements
+ *   map fill      insert 100000 keys into an unordered_map and erase
+ *                 them again in a different order
+ *   map churn     replace random keys of an unordered_map holding
+ *                 10000 entries, a node allocation and free per step
+ *
+ * usage: cxxbench [-s scale]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+
+#include "mm.hpp"
+#include "memlib.h"
+
+#define GROW_OPS     4000000     /* elements pushed by vector grow */
+#define SMALL_OPS    400000      /* vectors built by vector small */
+#define FILL_KEYS    100000      /* keys per map fill round */
+#define FILL_ROUNDS  10
+#define CHURN_KEYS   10000       /* entries held by map churn */
+#define CHURN_OPS    2000000     /* replacements made by map churn */
+
+static int scale = 1;
+static volatile uint64_t sink;   /* keeps results alive */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *seed >> 17;
+}
+
+/*
+ * The containers of one allocator: Alloc<T> is the allocator for
+ * elements of type T
+ */
+template <class T> using std_alloc = std::allocator<T>;
+template <class T> using mm_alloc = mm::allocator<T>;
+template <class T> using pmr_alloc = std::pmr::polymorphic_allocator<T>;
+
+template <template <class> class Alloc>
+struct containers {
+    using vector = std::vector<uint64_t, Alloc<uint64_t>>;
+    using map = std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                                   Alloc<std::pair<const uint64_t, uint64_t>>>;
+};
+
+/* each returns nanoseconds per operation */
+template <template <class> class Alloc>
+static double vector_grow(void)
+{
+    uint64_t seed = 1, total = 0;
+    size_t ops = (size_t)GROW_OPS * scale;
+
+    double begin = now();
+    for (size_t done = 0; done < ops; ) {
+        typename containers<Alloc>::vector v;
+        size_t n = 1 + next_random(&seed) % 4096;
+        for (size_t i = 0; i < n; i++)
+            v.push_back(i);
+        total += v.back();
+        done += n;
+    }
+    double elapsed = now() - begin;
+    sink = total;
+    return elapsed * 1e9 / ops;
+}
+
+template <template <class> class Alloc>
+static double vector_small(void)
+{
+    uint64_t seed = 1, total = 0;
+    size_t ops = (size_t)SMALL_OPS * scale;
+
+    double begin = now();
+    for (size_t r = 0; r < ops / 64; r++) {
+        std::vector<typename containers<Alloc>::vector> group;
+        group.reserve(64);
+        for (size_t i = 0; i < 64; i++) {
+            group.emplace_back(1 + next_random(&seed) % 64, i);
+            total += group.back().size();
+        }
+    }
+    double elapsed = now() - begin;
+    sink = total;
+    return elapsed * 1e9 / ops;
+}
+
+template <template <class> class Alloc>
+static double map_fill(void)
+{
+    uint64_t total = 0;
+    size_t rounds = (size_t)FILL_ROUNDS * scale;
+
+    double begin = now();
+    for (size_t r = 0; r < rounds; r++) {
+        typename containers<Alloc>::map m;
+        uint64_t seed = r + 1;
+        for (size_t i = 0; i < FILL_KEYS; i++)
+            m.emplace(next_random(&seed), i);
+        total += m.size();
+        seed = r + 1;
+        for (size_t i = 0; i < FILL_KEYS; i++)
+            m.erase(next_random(&seed));
+    }
+    double elapsed = now() - begin;
+    sink = total;
+    return elapsed * 1e9 / (rounds * FILL_KEYS * 2);
+}
+
+template <template <class> class Alloc>
+static double map_churn(void)
+{
+    uint64_t seed = 1, total = 0;
+    size_t ops = (size_t)CHURN_OPS * scale;
+    std::vector<uint64_t> keys(CHURN_KEYS);
+    typename containers<Alloc>::map m;
+
+    for (size_t i = 0; i < CHURN_KEYS; i++)
+        m.emplace(keys[i] = next_random(&seed), i);
+
+    double begin = now();
+    for (size_t i = 0; i < ops; i++) {
+        size_t slot = next_random(&seed) % CHURN_KEYS;
+        m.erase(keys[slot]);
+        m.emplace(keys[slot] = next_random(&seed), i);
+    }
+    double elapsed = now() - begin;
+    total += m.size();
+    sink = total;
+    return elapsed * 1e9 / ops;
+}
+
+struct workload {
+    const char *name;
+    double (*run[3])(void);
+};
+
+#define WORKLOAD(name, fn) { name, { fn<std_alloc>, fn<mm_alloc>, fn<pmr_alloc> } }
+
+static struct workload workloads[] = {
+    WORKLOAD("vector grow", vector_grow),
+    WORKLOAD("vector small", vector_small),
+    WORKLOAD("map fill", map_fill),
+    WORKLOAD("map churn", map_churn),
+};
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "s:h")) != -1) {
+        switch (c) {
+        case 's':
+            scale = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: cxxbench [-s scale]\n");
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (scale < 1)
+        scale = 1;
+
+    mem_init();
+    if (mm_init() < 0) {
+        fprintf(stderr, "cxxbench: mm_init failed\n");
+        exit(1);
+    }
+    std::pmr::set_default_resource(mm::get_memory_resource());
+
+    printf("ns per operation\n");
+    printf("%-14s %10s %10s %10s %8s\n", "workload", "std", "mm", "mm pmr", "speedup");
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        struct workload *w = &workloads[i];
+        double lib = w->run[0]();
+        double alloc = w->run[1]();
+        double pmr = w->run[2]();
+
+        printf("%-14s %10.1f %10.1f %10.1f %8.2f\n", w->name, lib, alloc, pmr, lib / alloc);
+    }
+
+    if (!mm_check()) {
+        fprintf(stderr, "cxxbench: mm_check failed\n");
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * cxxtest - checks of mm.hpp and mm.h that the benchmarks do not make
+ *
+ * A slab object has no header, so the word in front of it is the end
+ * of the previous slot's data.  Each object freed here through
+ * free_fixed or mm::allocator sits right after one whose data ends in
+ * a word that looks like a mapped block's header, and must still go
+ * back to its slab run rather than to munmap.
+ *
+ * mm_usable_size of a block with its own mapping must cover the
+ * request, for sizes either side of a page boundary.
+ *
+ * usage: cxxtest
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "mm.hpp"
+#include "memlib.h"
+
+#define OBJECTS     64
+#define FAKE_HEADER 0x1005      /* size 0x1000 with the MMAPPED and allocated bits */
+
+struct object {
+    uint64_t word[4];
+};
+
+static int failures;
+
+static void expect(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "cxxtest: %s\n", what);
+        failures++;
+    }
+}
+
+/* free every object that directly follows another, after making the
+   last word of the one in front look like a mapped block's header */
+template <class Free>
+static void free_after_fake_header(void **objects, size_t size, Free free_one)
+{
+    std::vector<bool> freed(OBJECTS);
+
+    for (size_t i = 0; i < OBJECTS; i++) {
+        for (size_t j = 0; j < OBJECTS; j++) {
+            if (!freed[i] && !freed[j] && (char *)objects[j] == (char *)objects[i] + size) {
+                *(uint64_t *)((char *)objects[j] - 8) = FAKE_HEADER;
+                free_one(objects[j]);
+                freed[j] = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < OBJECTS; i++)
+        if (!freed[i])
+            free_one(objects[i]);
+}
+
+static void check_heap(const char *what)
+{
+    struct mm_stats stats;
+
+    mm_tcache_flush();
+    mm_stats(&stats);
+    expect(stats.mapped_blocks == 0, what);
+    expect(stats.mapped_bytes == 0, what);
+    expect(mm_check() != 0, what);
+}
+
+/* requests at and above the mmap threshold around a few page boundaries */
+static void check_mapped_usable_size(void)
+{
+    for (size_t pages = 1; pages <= 256; pages *= 4) {
+        for (size_t size = pages * 4096 - 32; size <= pages * 4096 + 16; size += 8) {
+            if (size < 4096)
+                continue;
+            char *p = (char *)mm_malloc(size);
+            expect(p != nullptr, "mm_malloc failed");
+            if (!p)
+                continue;
+            size_t usable = mm_usable_size(p);
+            expect(usable >= size, "mm_usable_size of a mapping is below its request");
+            memset(p, 0xa5, usable);
+            mm_free(p);
+        }
+    }
+}
+
+int main(void)
+{
+    void *objects[OBJECTS];
+
+    mem_init();
+    if (mm_init() < 0) {
+        fprintf(stderr, "cxxtest: mm_init failed\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < OBJECTS; i++)
+        objects[i] = mm::malloc_fixed<32>();
+    free_after_fake_header(objects, 32, [](void *p) { mm::free_fixed<32>(p); });
+    check_heap("free_fixed sent a slab object to munmap");
+
+    mm::allocator<object> alloc;
+    for (size_t i = 0; i < OBJECTS; i++)
+        objects[i] = alloc.allocate(1);
+    free_after_fake_header(objects, sizeof(object), [&](void *p) { alloc.deallocate((object *)p, 1); });
+    check_heap("mm::allocator sent a slab object to munmap");
+
+    /* with no thread cache, heap blocks and mappings take the same path */
+    mm_tcache_set_capacity(0, 0);
+    mm_set_mmap_threshold(4096);
+    void *block = mm::malloc_fixed<512>();
+    void *mapped = mm::malloc_fixed<8192>();
+    mm::free_fixed<512>(block);
+    mm::free_fixed<8192>(mapped);
+    check_heap("free_fixed lost track of a heap block or a mapping");
+
+    check_mapped_usable_size();
+    check_heap("mm_usable_size left a mapping behind");
+
+    if (failures)
+        return 1;
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * fbench - cache misses per malloc on a heap of many free blocks
+ *
+ * Each pattern keeps a live set of heap blocks between 2 and 4 KiB,
+ * too large for the thread cache and the quick-lists, spread over a
+ * heap much larger than the CPU caches, and replaces them one at a
+ * time.  Every malloc and free links and unlinks free blocks far
+ * apart in the heap, so the cost is in the cache lines of free blocks
+ * the free lists touch.
+ *
+ *   churn    free a random block of the set and allocate a new one
+ *   fifo     free the oldest block of the set and allocate a new one
+ *
+ * For each it prints the nanoseconds, last level cache misses and L1
+ * data cache misses per malloc, along with the free that goes with
+ * it, from the fastest of RUNS runs on a fresh heap.  The miss counts
+ * come from perf_event_open and read n/a where the kernel or the
+ * machine does not provide them.
+ *
+ * usage: fbench [-s scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define LIVE		16384		/* blocks in the live set, about 50 MiB */
+#define OPS			4000000		/* replacements per pattern */
+#define MIN_SIZE	2100
+#define MAX_SIZE	4000
+#define RUNS		3			/* runs per pattern, the fastest is reported */
+
+enum { CACHE_MISSES, L1D_MISSES, COUNTERS };
+
+static int scale = 1;
+static int counters[COUNTERS] = { -1, -1 };
+static void* live[LIVE];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t random_size(unsigned int* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return MIN_SIZE + (*seed >> 8) % (MAX_SIZE - MIN_SIZE + 1);
+}
+
+static void fail(const char* what)
+{
+	fprintf(stderr, "fbench: %s failed\n", what);
+	exit(1);
+}
+
+/* open a counter of the calling thread in user space, or return -1 */
+static int open_counter(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counters(void)
+{
+	for (int i = 0; i < COUNTERS; i++) {
+		if (counters[i] >= 0) {
+			ioctl(counters[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counters[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/* stop the counters and read them into counts, -1 for none */
+static void stop_counters(double* counts)
+{
+	for (int i = 0; i < COUNTERS; i++) {
+		uint64_t value;
+		counts[i] = -1;
+		if (counters[i] < 0)
+			continue;
+		ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counters[i], &value, sizeof(value)) == sizeof(value))
+			counts[i] = (double)value;
+	}
+}
+
+static void fill(unsigned int* seed)
+{
+	for (size_t i = 0; i < LIVE; i++) {
+		size_t size = random_size(seed);
+		if (!(live[i] = mm_malloc(size)))
+			fail("mm_malloc");
+		memset(live[i], 0, size);
+	}
+}
+
+/* returns nanoseconds per malloc, and the misses per malloc in misses */
+static double run(int fifo, double* misses)
+{
+	unsigned int seed = 1;
+	size_t ops = (size_t)OPS * scale;
+	size_t oldest = 0;
+
+	fill(&seed);
+
+	/* free a random half first, so the heap starts out full of holes */
+	for (size_t i = 0; i < LIVE; i++) {
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 8) & 1) {
+			mm_free(live[i]);
+			if (!(live[i] = mm_malloc(random_size(&seed))))
+				fail("mm_malloc");
+		}
+	}
+
+	start_counters();
+	double begin = now();
+	for (size_t r = 0; r < ops; r++) {
+		size_t slot;
+		if (fifo) {
+			slot = oldest;
+			oldest = (oldest + 1) % LIVE;
+		} else {
+			seed = seed * 1103515245 + 12345;
+			slot = (seed >> 8) % LIVE;
+		}
+		mm_free(live[slot]);
+		if (!(live[slot] = mm_malloc(random_size(&seed))))
+			fail("mm_malloc");
+		*(char*)live[slot] = (char)r;
+	}
+	double elapsed = now() - begin;
+	stop_counters(misses);
+
+	for (int i = 0; i < COUNTERS; i++)
+		if (misses[i] >= 0)
+			misses[i] /= ops;
+
+	for (size_t i = 0; i < LIVE; i++)
+		mm_free(live[i]);
+	return elapsed * 1e9 / ops;
+}
+
+static void print_count(double count)
+{
+	if (count < 0)
+		printf(" %10s", "n/a");
+	else
+		printf(" %10.2f", count);
+}
+
+int main(int argc, char** argv)
+{
+	static const char* names[] = { "churn", "fifo" };
+	int c;
+
+	while ((c = getopt(argc, argv, "s:h")) != -1) {
+		switch (c) {
+		case 's':
+			scale = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: fbench [-s scale]\n");
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+	if (scale < 1)
+		scale = 1;
+
+	counters[CACHE_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	counters[L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	                                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+	mem_init();
+
+	printf("per malloc and free of %d to %d bytes, %d blocks live\n", MIN_SIZE, MAX_SIZE, LIVE);
+	printf("%-8s %10s %10s %10s\n", "pattern", "ns", "misses", "L1d misses");
+
+	for (int fifo = 0; fifo < 2; fifo++) {
+		double best = 0, bestMisses[COUNTERS];
+
+		for (int r = 0; r < RUNS; r++) {
+			double misses[COUNTERS];
+
+			mem_reset_brk();
+			if (mm_init() < 0)
+				fail("mm_init");
+
+			double ns = run(fifo, misses);
+			if (r == 0 || ns < best) {
+				best = ns;
+				memcpy(bestMisses, misses, sizeof(misses));
+			}
+
+			if (!mm_check())
+				fail("mm_check");
+		}
+
+		printf("%-8s %10.1f", names[fifo], best);
+		print_count(bestMisses[CACHE_MISSES]);
+		print_count(bestMisses[L1D_MISSES]);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * memlib.c - a module that simulates the memory system.  Needed because it
+ *            allows us to interleave calls from the student's malloc package
+ *            with the system's malloc package in libc.
+ *
+ * The simulated heap is reserved with a single anonymous mapping, so
+ * only the pages the allocator actually touches take up memory, and
+ * pages released by madvise or by moving the break down are given
+ * back to the system for real.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+
+#include "memlib.h"
+#include "config.h"
+
+/* private variables */
+static char *mem_start_brk;  /* points to first byte of heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */
+
+/*
+ * mem_init - initializes the memory system model
+ */
+void mem_init(void)
+{
+    /* reserve the storage we will use to model the available VM */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
+        exit(1);
+    }
+
+    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_brk = mem_start_brk;                  /* heap is empty initially */
+}
+
+/*
+ * mem_deinit - frees the storage used by the memory system model
+ */
+void mem_deinit(void)
+{
+    munmap(mem_start_brk, MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ */
+void mem_reset_brk()
+{
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_sbrk - simple model of the sbrk function. Extends the heap
+ *    by incr bytes and returns the start address of the new area.  A
+ *    negative incr shrinks the heap, and the pages it gives up are
+ *    released.  In this model, the heap cannot be shrunk below its
+ *    start or grown past MAX_HEAP.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    char *old_brk = mem_brk;
+
+    if ((incr < 0 && -incr > mem_brk - mem_start_brk) ||
+        (incr > 0 && incr > mem_max_addr - mem_brk)) {
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+
+    mem_brk += incr;
+
+    if (incr < 0) {
+        /* only whole pages past the new break can be released */
+        size_t pagesize = mem_pagesize();
+        char *start = (char *)(((uintptr_t)mem_brk + pagesize - 1) & ~(pagesize - 1));
+        if (start < old_brk)
+            madvise(start, old_brk - start, MADV_DONTNEED);
+    }
+
+    return (void *)old_brk;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo()
+{
+    return (void *)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi()
+{
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize()
+{
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize()
+{
+    return (size_t)getpagesize();
+}
@@ -1,24 +1,65 @@
 /*
  *
- * This implementation uses segregated free lists.  A global array
- * contains pointer to 15 distinct free lists, where each list holds
- * free blocks in a certain range.
+ * This implementation uses segregated free lists.  Each arena holds
+ * an array of pointers to LIST_COUNT distinct free lists, where each
+ * list holds free blocks in a certain range.  The ranges follow a two
+ * level scheme: every power of two is split into 1 << SL_BITS equal
+ * subranges, and sizes below 16 << SL_BITS get one list per 16 bytes.
+ * With SL_BITS == 3:
  *
- * Index 0 - 32 byte blocks
- * Index 1 - 33-64 byte blocks
- * Index 2 - 65-128 byte blocks
+ * Index 2 - 32 byte blocks
+ * Index 3 - 48 byte blocks
+ * ...
+ * Index 15 - 240 byte blocks
+ * Index 16 - 256-287 byte blocks
+ * ...
+ * Index 23 - 480-511 byte blocks
+ * Index 24 - 512-575 byte blocks
  * ...
- * Index 14 - 32769-65536 byte blocks
+ *
+ * A request is rounded up to the start of the next range, so every
+ * block in that list or any higher one fits, and a bitmap of non-empty
+ * lists finds the first such list with two count-trailing-zeros.
  *
  * The format of an allocated block is the following:
- * [8 byte header][16 byte aligned data][8 byte footer]
+ * [8 byte header][16 byte aligned data]
  *
  * The format of a free block is the following:
- * [8 byte header][8 byte pointer to previous block][unused][8 byte pointer to next block][8 byte footer]
+ * [8 byte header][8 byte pointer to previous block][8 byte pointer to next block][unused][8 byte footer]
+ * The header and both links sit in the first 24 bytes of the block, so
+ * walking a list or unlinking a block reads the same line or two at the
+ * front of each block however large it is.  Headers sit 8 bytes past a
+ * multiple of 16, and only one in the last 8 bytes of a 64 byte line
+ * has its links in the next line; in the other three places they share
+ * the header's line.
+ *
+ * Lists for blocks of TREE_MIN_SIZE bytes and up are not lists at all.
+ * Each holds the root of a red-black tree ordered by block size and then
+ * address, and each node sits at the front of its free block:
+ * [8 byte header][parent][smaller child][larger child][colour][freed time][unused][8 byte footer]
+ * A large request takes the smallest block that fits from its own tree,
+ * or else the smallest block in the next non-empty tree, giving a best
+ * fit in O(log n) however many large blocks are free.
  *
- * The header and footer fields are identical, and contain
- * the size of the entire block.  The least significant bit
- * of the size refers to the allocation of the block (0 == free, 1 == allocated)
+ * Requests of at least mmapThreshold bytes bypass the arenas and get a
+ * mapping of their own, laid out as
+ * [8 bytes unused][8 byte header][16 byte aligned data]
+ * where the header holds the length of the mapping less 8 bytes along
+ * with the MMAPPED bit, and the mapping is unmapped when the block is freed.
+ *
+ * Requests of at most SLAB_MAX_SIZE bytes do not get blocks of their own.
+ * They are served from slab runs: page aligned allocated blocks whose page
+ * holds a run header followed by objects of a single size class, with a
+ * bitmap of free slots and no per-object header or footer.  The page map
+ * entry of a run page carries a flag, so mm_free can tell a slab object
+ * from a block and find its run by masking off the low bits of the address.
+ *
+ * The header contains the size of the entire block.  The least significant
+ * bit of the size refers to the allocation of the block (0 == free, 1 == allocated)
+ * and the next bit refers to the allocation of the block just before it
+ * in memory.  Only free blocks carry a footer, which is identical to the
+ * header, so coalesce can find the start of a free previous block once
+ * the header has told it that the previous block is free.
  * The pointers point to the header of the adjacent block in the free list.
  *
  * When a block is freed, it is added to the front of the existing free list.
@@ -30,13 +71,58 @@
  * Before any block is added to a free list, it is coalesced with its
  * neighboring blocks, if possible.
  *
+ * The heap is split between up to MAX_ARENAS independent arenas, each
+ * with its own lock, free lists and heap segments.  A segment is a page
+ * aligned run of pages taken from mem_sbrk:
+ * [segment header][16 byte prologue][blocks...][8 byte epilogue header]
+ * The prologue and epilogue are marked allocated, so coalesce never
+ * walks off a segment into memory owned by another arena.  An arena
+ * whose newest segment still ends at the break grows it in place,
+ * otherwise it starts a new segment.  A page map from page number to
+ * segment lets mm_free send any block back to the arena that owns it.
+ * Threads are given an arena round-robin on first use, or by the CPU
+ * they are running on (see mm_set_arenas).
+ *
+ * In front of the arenas, each thread keeps a small cache of recently freed
+ * blocks, one singly linked stack per exact block size up to
+ * TCACHE_MAX_SIZE.  A cached block stays marked as allocated in the
+ * heap, so coalesce never touches it, and the next pointer of the stack
+ * lives in the first 8 bytes of its data section.  mm_malloc pops from
+ * the cache without taking a lock; when a stack is empty it is refilled
+ * from the thread's arena with a batch of blocks under a single lock
+ * acquisition.  mm_free pushes onto the cache, and once a stack grows
+ * past its capacity half of it is flushed back to the owning arenas.
+ *
+ * Heap blocks of up to QUICK_MAX_SIZE bytes that reach an arena are not
+ * coalesced straight away either.  They go on a quick-list for their exact
+ * size, still marked as allocated, and are handed out again as they are.
+ * The quick-lists are consolidated, freeing every block on them properly,
+ * before the heap is extended and whenever one of them grows too long.
+ * A thread's cache is flushed entirely when the thread exits.
+ *
+ * When sampling is turned on, mm_malloc counts the bytes each thread
+ * allocates down from a random, exponentially distributed countdown, and
+ * records the call stack of the allocation that runs it out.  Sampled
+ * blocks go in a hash table outside the heap, and stay there until
+ * mm_free sees them again.
+ *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <math.h>
+#include <execinfo.h>
+#include <errno.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -63,9 +149,247 @@ team_t team = {
  * You are not required to use these macros but may find them helpful.
 *************************************************************************/
 
-static const unsigned int arrayLength = 15;		// number of free lists
-static char* array[15];							// array of free list pointers
-static char* heapStart;							// pointer to first byte used on heap
+#define SL_BITS				3					// log2 of the subranges per power of two, 2..4
+#define FL_MAX				44					// log2 of the largest block size in 16 byte units
+#define LIST_COUNT			((FL_MAX - SL_BITS + 2) << SL_BITS)	// number of free lists
+#define BINMAP_WORDS		((LIST_COUNT + 63) / 64)
+
+#define MAX_REQUEST			((size_t)1 << 46)	// largest request that is not refused outright
+
+static const unsigned int arrayLength = LIST_COUNT;
+
+#define TREE_MIN_SIZE		4096				// smallest free block kept in a tree instead of a list
+#define TREE_MIN_INDEX		((9 - SL_BITS) << SL_BITS)	// getIndex(TREE_MIN_SIZE), the first tree list
+
+// a free block of at least TREE_MIN_SIZE bytes is a node of
+// the red-black tree of its list, ordered by size and then by
+// address, in place of the prev and next pointers.  freedTime
+// is where getFreedTime expects it, clear of the list links
+// that place() resets when the block is allocated
+struct tree_node
+{
+	uintptr_t header;
+	struct tree_node* parent;
+	struct tree_node* child[2];					// smaller and larger nodes
+	uintptr_t red;
+	uint64_t freedTime;
+};
+static unsigned int heapGeneration;				// bumped by mm_init, invalidates thread caches
+
+#define MAX_ARENAS			64					// most arenas that can be configured
+#define PAGE_SHIFT			12
+#define PAGE_BYTES			(1UL << PAGE_SHIFT)
+#define HUGE_PAGE_BYTES		(2UL * 1024 * 1024)	// transparent huge page size on x86-64
+#define SEGMENT_MIN_SIZE	(64 * 1024)			// smallest new segment an arena takes from mem_sbrk
+#define SEGMENT_OVERHEAD	48					// segment header, prologue and epilogue
+#define GROW_INTERVAL		100					// milliseconds between extensions that count as a growing heap
+#define GROW_MAX_SIZE		(4 * 1024 * 1024)	// largest headroom added to a growing arena
+#define MMAP_THRESHOLD		(256 * 1024)		// default smallest request given its own mapping
+#define BATCH_MAX_BYTES		(1024 * 1024)		// most heap mm_malloc_batch carves from one block
+#define HEAP_SEGMENT_MAX	(64 * 1024 * 1024)	// largest segment a private heap doubles up to
+
+static size_t mmapThreshold = MMAP_THRESHOLD;
+
+static int hugePages;							// set by mm_set_huge_pages, read by mm_init
+static size_t chunkBytes = PAGE_BYTES;			// unit the break moves and free blocks are purged in
+
+#define DECAY_MIN_SIZE		(16 * 1024)			// smallest free block whose pages are purged, a power of two
+#define DECAY_TIME			10000				// default milliseconds a free block sits before it is purged
+
+#define QUICK_MAX_SIZE		2048				// largest block size kept on a quick-list
+// one quick-list per heap block size above SLAB_MAX_SIZE
+#define QUICK_CLASSES		((QUICK_MAX_SIZE - SLAB_MAX_SIZE) / 16)
+#define QUICK_DEFAULT_LIMIT	64					// default longest quick-list before consolidating
+
+static unsigned int quickLimit = QUICK_DEFAULT_LIMIT;	// 0 turns quick-lists off
+
+static long decayTime = DECAY_TIME;				// negative turns purging off
+static struct mm_purge_stats purgeStats;		// updated atomically, any arena lock may be held
+
+#define SLAB_MAX_SIZE		256					// largest request served from a slab run
+#define SLAB_CLASSES		(SLAB_MAX_SIZE / 16)	// one class per 16 bytes of object size
+#define RUN_HEADER_SIZE		64					// bytes of struct run, rounded up to 16
+#define RUN_BLOCK_SIZE		(PAGE_BYTES + 16)	// heap block holding a page aligned run
+
+// header at the start of every slab run, a page holding
+// objects of a single size class with no per-object
+// header.  Objects start RUN_HEADER_SIZE bytes in, and
+// a set bit in the bitmap marks a free slot
+struct run
+{
+	struct run* next;							// runs of the same class with free slots
+	struct run* prev;
+	unsigned short sizeClass;
+	unsigned short freeCount;
+	unsigned short capacity;
+	uint64_t bitmap[(PAGE_BYTES - RUN_HEADER_SIZE) / 16 / 64 + 1];
+};
+
+#define PROBE_BUCKETS		MM_PROBE_BUCKETS	// find_fit probe counts 0, 1, 2, 3-4, 5-8, ... and more
+
+// counters kept by every arena under its lock, added up by mm_stats
+struct arena_stats
+{
+	uint64_t allocs[LIST_COUNT];				// heap block requests, by the list of their size
+	uint64_t frees[LIST_COUNT];					// heap blocks freed, by the list of their size
+	uint64_t freeBlocks[LIST_COUNT];			// blocks on each free list
+	uint64_t freeBytes[LIST_COUNT];				// bytes on each free list
+	uint64_t slabAllocs[SLAB_CLASSES];			// slab objects allocated, by size class
+	uint64_t slabFrees[SLAB_CLASSES];			// slab objects freed, by size class
+	uint64_t splits;							// blocks split in two
+	uint64_t coalesces;							// free neighbours merged into a block
+	uint64_t extends;							// extend_heap calls
+	uint64_t remoteFrees;						// blocks freed from the remote list
+	uint64_t probes[PROBE_BUCKETS];				// find_fit calls, by blocks looked at
+};
+
+struct arena;
+
+// header at the start of every heap segment, followed by
+// the 16 byte prologue block so that the first real block
+// header is 8 byte aligned but not 16 byte aligned
+struct segment
+{
+	struct arena* arena;						// arena owning every block in the segment
+	struct segment* next;						// next older segment of the same arena
+	size_t size;								// bytes in the segment, a multiple of PAGE_BYTES
+	uintptr_t prologue[2];						// header and footer of the prologue block
+};
+
+struct arena
+{
+	char* remote;								// blocks freed by other threads, pushed without the lock
+	pthread_mutex_t lock;						// protects everything below
+	char* array[LIST_COUNT];					// array of free list pointers
+	uint64_t binmap[BINMAP_WORDS];				// bit i set while array[i] is non-empty
+	unsigned int binSummary;					// bit w set while binmap[w] is non-zero
+	struct segment* segments;					// newest segment first
+	struct run* runs[SLAB_CLASSES];				// runs with at least one free slot
+	char* quick[QUICK_CLASSES];					// data pointer of the first block of each quick-list
+	unsigned int quickCount[QUICK_CLASSES];		// number of blocks on each quick-list
+	unsigned int quickBlocks;					// number of blocks on all quick-lists
+	uint64_t lastDecay;							// time of the last sweep for unused free blocks
+	uint64_t lastGrow;							// time the arena last ran out of free blocks
+	char* fresh;								// end of the memory ever allocated in the newest segment
+	char* freshStart;							// fresh as the newest segment started out
+	size_t growSize;							// headroom added when it next runs out
+	struct arena_stats stats;
+	struct mm_heap* heap;						// private heap owning the arena, NULL for a shared one
+	unsigned int index;
+};
+
+// a private heap: an arena of its own, outside arenas[],
+// whose segments are mapped instead of taken from mem_sbrk
+// so they can be unmapped again.  In bump mode the free
+// lists go unused and blocks are carved one after another
+// from the newest segment
+struct mm_heap
+{
+	struct arena arena;
+	int mode;									// MM_HEAP_GENERAL or MM_HEAP_BUMP
+	char* bump;									// next free byte of the newest segment, bump mode
+	char* bumpEnd;								// end of the newest segment, bump mode
+};
+
+static struct arena arenas[MAX_ARENAS];
+static unsigned int numArenas;					// arenas in use since the last mm_init
+static unsigned int configuredArenas;			// 0 means one per online CPU
+static int arenaPolicy = MM_ARENA_ROUND_ROBIN;
+static unsigned int nextArena;					// round-robin assignment counter
+
+// protects mem_sbrk and the page map
+static pthread_mutex_t sbrkLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t sbrkCalls;						// mem_sbrk calls, under sbrkLock
+static char* highWater;							// highest break so far, under sbrkLock.  mem_reset_brk
+												// leaves the memory below it as it was, so it may not be zero
+static size_t mappedBytes;						// bytes in direct mappings, updated atomically
+static uint64_t mappedBlocks;					// live direct mappings, updated atomically
+
+// two level page map from a page number to the segment holding
+// that page, leaves are mapped on demand when a segment is created.
+// Segments are page aligned, so the low bits of an entry are free
+// to mark pages used as slab runs
+#define PAGEMAP_LEAF_BITS	18
+#define PAGEMAP_ROOT_BITS	(48 - PAGE_SHIFT - PAGEMAP_LEAF_BITS)
+#define RUN_PAGE			1					// page map entry bit for a slab run page
+static uintptr_t* pagemap[1 << PAGEMAP_ROOT_BITS];
+static uintptr_t unmappedPage;					// entry for pages with no leaf, always 0
+
+
+#define TCACHE_MAX_SIZE		1024				// largest block size kept in a thread cache
+// one class per slab class, then one per heap block size above SLAB_MAX_SIZE
+#define TCACHE_CLASSES		(SLAB_CLASSES + (TCACHE_MAX_SIZE - SLAB_MAX_SIZE) / 16)
+#define TCACHE_DEFAULT_CAP	16					// default number of blocks cached per class
+
+// per-class capacity of the thread caches, shared by every thread
+static unsigned int tcacheCapacity[TCACHE_CLASSES] = { [0 ... TCACHE_CLASSES - 1] = TCACHE_DEFAULT_CAP };
+
+struct tcache
+{
+	unsigned int generation;					// heapGeneration this cache was filled in
+	struct arena* arena;						// arena this thread allocates from
+	unsigned int count[TCACHE_CLASSES];			// number of blocks in each stack
+	char* head[TCACHE_CLASSES];					// data pointer of the top block of each stack
+};
+
+static __thread struct tcache threadCache;
+static __thread int threadCacheRegistered;
+static pthread_key_t tcacheKey;
+static pthread_once_t tcacheKeyOnce = PTHREAD_ONCE_INIT;
+
+#define PROFILE_DEPTH		32					// deepest call stack kept for a sample
+#define PROFILE_CHUNK		(1024 * 1024)		// bytes mapped at a time for profile records
+#define SAMPLE_HASH_BITS	14					// buckets in the table of sampled blocks
+#define STACK_HASH_BITS		12					// buckets in the table of call stacks
+#define SAMPLE_FILTER_BITS	16					// counters in the filter mm_free checks first
+
+// a call stack that sampled blocks were allocated from,
+// with the totals pprof reports for it
+struct stack
+{
+	struct stack* next;							// next stack in the same hash bucket
+	struct stack* all;							// next stack in the order they were seen
+	uint64_t hash;
+	uint64_t allocs, allocBytes;				// samples taken here
+	uint64_t frees, freeBytes;					// of those, samples freed again
+	int depth;
+	void* pcs[PROFILE_DEPTH];
+};
+
+// a sampled block that has not been freed yet
+struct sample
+{
+	struct sample* next;						// next sample in the same hash bucket
+	void* data;									// data pointer handed out
+	size_t size;								// bytes asked for
+	struct stack* stack;
+};
+
+static size_t sampleRate;						// mean bytes between samples, 0 turns sampling off
+static size_t profileRate;						// last rate sampling was on with, for the dump header
+static uint64_t sampledBlocks;					// live samples, updated atomically
+static __thread intptr_t sampleCountdown;		// bytes left before the thread takes a sample
+static __thread uint64_t sampleSeed;			// 0 until the thread draws its first countdown
+static __thread int inProfiler;					// set while the thread records a sample
+
+// everything below is protected by profileLock
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+static struct sample* sampleTable[1 << SAMPLE_HASH_BITS];
+static struct stack* stackTable[1 << STACK_HASH_BITS];
+static struct stack* stackList;					// every stack, newest first
+static struct sample* freeSamples;				// sample records ready for reuse
+static char* profileChunks;						// mapped chunks, linked through their first word
+static char* profileBump;						// next free byte in the newest chunk
+static char* profileEnd;						// end of the newest chunk
+
+// counts of live samples per hash of their data pointer, read
+// without the lock so mm_free can skip blocks never sampled
+static uint16_t sampleFilter[1 << SAMPLE_FILTER_BITS];
+
+// set by the dump signal handler when it could not dump at once
+static volatile sig_atomic_t profileDumpPending;
+static char profilePrefix[256];					// file name prefix for dumps on a signal
+static unsigned int profileDumps;				// dumps written on a signal so far
 
 enum Status
 {
@@ -73,72 +397,113 @@ enum Status
 	ALLOCATED
 };
 
+#define PREV_ALLOCATED		2					// header bit set when the previous block is allocated
+#define MMAPPED				4					// header bit of a block with a mapping of its own
+#define MIN_BLOCK_SIZE		32					// header, two list pointers and footer
+
 /**********************************************************
  * HELPER FUNCTIONS
  **********************************************************/
 
+static void free_block(struct arena* arena, void *bp);
+static void decay_arena(struct arena* arena, int all);
+static void profile_reset(void);
+
 
 // Round up a block size to the nearest
 // 16 bytes
-static unsigned int roundUp(size_t size)
+static size_t roundUp(size_t size)
 {
 	if( 0 == size % 16 )
-		return (unsigned int) size;
+		return size;
 
 	size &= ~15;
 	size += 16;
-	return (unsigned int) size;
+	return size;
 }
 
 
-// given size, multiple of 16 between 2^5 and 2^19,
-// find the corresponding array index, by rounding
-// the size up to the next power of 2, corresponding
-// to the free list pointed to by array[index]
-static unsigned int getIndex(unsigned int size)
+// given size, multiple of 16 and at least 32,
+// find the corresponding array index: the power
+// of two below the size picks a group of lists,
+// and the next SL_BITS bits pick the list within it
+static unsigned int getIndex(size_t size)
 {
 	assert(size >= 32);
 
-	if( size == 32 )
-		return 0;
-	else if( size <= 64 )
-		return 1;
-	else if( size <= 128 )
-		return 2;
-	else if( size <= 256 )
-		return 3;
-	else if( size <= 512 )
-		return 4;
-	else if( size <= 1024 )
-		return 5;
-	else if( size <= 2048 )
-		return 6;
-	else if( size <= 4096 )
-		return 7;
-	else if( size <= 8192 )
-		return 8;
-	else if( size <= 16384 )
-		return 9;
-	else if( size <= 32768 )
-		return 10;
-	else if( size <= 65536 )
-		return 11;
-	else if( size <= 131072 )
-		return 12;
-	else if( size <= 262144 )
-		return 13;
-	else // if( size <= 524288 )
-		return 14;
+	size_t units = size >> 4;
+	unsigned int fl = 63 - __builtin_clzll(units | ((2u << SL_BITS) - 1));
+
+	return ((fl - SL_BITS) << SL_BITS) + (units >> (fl - SL_BITS));
+}
+
+
+// given size, multiple of 16 and at least 32,
+// find the first array index whose blocks are all
+// at least size bytes, by rounding the size up to
+// the start of the next range
+static unsigned int getFitIndex(size_t size)
+{
+	size_t units = size >> 4;
+	unsigned int fl = 63 - __builtin_clzll(units | ((2u << SL_BITS) - 1));
+
+	units += ((size_t)1 << (fl - SL_BITS)) - 1;
+	return getIndex(units << 4);
+}
+
+
+// mark the list at index as non-empty
+static void setBin(struct arena* arena, unsigned int index)
+{
+	arena->binmap[index >> 6] |= 1ULL << (index & 63);
+	arena->binSummary |= 1u << (index >> 6);
+}
+
+
+// mark the list at index as empty
+static void clearBin(struct arena* arena, unsigned int index)
+{
+	arena->binmap[index >> 6] &= ~(1ULL << (index & 63));
+	if( 0 == arena->binmap[index >> 6] )
+		arena->binSummary &= ~(1u << (index >> 6));
+}
 
+
+// return the first non-empty list at or above index,
+// or LIST_COUNT if there is none
+static unsigned int findBin(struct arena* arena, unsigned int index)
+{
+	unsigned int word = index >> 6;
+	uint64_t bits = arena->binmap[word] & (~0ULL << (index & 63));
+	if( bits )
+		return (word << 6) + __builtin_ctzll(bits);
+
+	unsigned int words = arena->binSummary & ~((2u << word) - 1);
+	if( !words )
+		return LIST_COUNT;
+
+	word = __builtin_ctz(words);
+	return (word << 6) + __builtin_ctzll(arena->binmap[word]);
+}
+
+
+// given a request size, return the size of the
+// block needed to hold it: the data rounded up to
+// 16 bytes along with the header, at least enough
+// to hold a free block
+static size_t getTotalSize(size_t size)
+{
+	size_t totalSize = roundUp(size + 8);
+	return (totalSize < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : totalSize;
 }
 
 
 // given a pointer to a block header
 // or footer, zero out the allocated
-// bit and return the size
-static unsigned int getSize(char* bp)
+// bits and return the size
+static size_t getSize(char* bp)
 {
-	return *(uintptr_t*)bp & ~1;
+	return *(uintptr_t*)bp & ~15;
 }
 
 
@@ -155,21 +520,60 @@ static enum Status getAlloc(char* bp)
 }
 
 
+// given a pointer to a block header, return
+// whether the block just before it is allocated
+static enum Status getPrevAlloc(char* bp)
+{
+	if( 0 == ( (*(uintptr_t*)bp) & PREV_ALLOCATED ) )
+		return FREE;
+	else
+		return ALLOCATED;
+}
+
+
+// given a pointer to a block header, record
+// whether the block just before it is allocated
+//
+// The block may be allocated and being read by mm_free
+// in another thread without the arena lock, so the
+// header is updated with a single atomic store
+static void setPrevAlloc(char* bp, enum Status prevAlloc)
+{
+	uintptr_t header = __atomic_load_n((uintptr_t*)bp, __ATOMIC_RELAXED);
+	if( ALLOCATED == prevAlloc )
+		header |= PREV_ALLOCATED;
+	else
+		header &= ~(uintptr_t)PREV_ALLOCATED;
+	__atomic_store_n((uintptr_t*)bp, header, __ATOMIC_RELAXED);
+}
+
+
+// given a pointer to the header of an allocated block
+// owned by the caller, return its size without taking
+// the arena lock, see setPrevAlloc
+static size_t getAllocatedSize(char* bp)
+{
+	return __atomic_load_n((uintptr_t*)bp, __ATOMIC_RELAXED) & ~15;
+}
+
+
 // given a pointer to the first byte in a block,
-// set the header and footer to the size
-// and allocation parameter
-static void setSizeAlloc(char* bp, unsigned int size, enum Status alloc)
+// set the header to the size and allocation
+// parameter, keeping the previous block bit that
+// is already in the header.  Free blocks also get
+// a footer with the same contents
+static void setSizeAlloc(char* bp, size_t size, enum Status alloc)
 {
-	char* lastHeader = bp + size - 8;
+	uintptr_t prevBit = *(uintptr_t*)bp & PREV_ALLOCATED;
 	if( ALLOCATED == alloc )
 	{
-		*(uintptr_t*)bp = (size | 1);
-		*(uintptr_t*)lastHeader = (size | 1);
+		*(uintptr_t*)bp = (size | prevBit | 1);
 	}
 	else if( FREE == alloc )
 	{
-		*(uintptr_t*)bp = (size & ~1);
-		*(uintptr_t*)lastHeader = (size & ~1);
+		char* lastHeader = bp + size - 8;
+		*(uintptr_t*)bp = (size | prevBit);
+		*(uintptr_t*)lastHeader = (size | prevBit);
 	}
 }
 
@@ -195,9 +599,7 @@ static void setPrev(char* bp, char* prev)
 // return a pointer to the next block in the free list
 static char* getNext(char* bp)
 {
-	unsigned int size = getSize(bp);
-	bp += size - 16;
-	unsigned long long pointer = *(uintptr_t*)bp;
+	unsigned long long pointer = *((uintptr_t*)bp + 2);
 	return (char*) pointer;
 }
 
@@ -206,482 +608,3963 @@ static char* getNext(char* bp)
 // set the pointer to the next block in the list
 static void setNext(char* bp, char* next)
 {
-	unsigned int size = getSize(bp);
-	bp += size - 16;
-	*(uintptr_t*)bp = (unsigned long long)next;
+	*((uintptr_t*)bp + 2) = (unsigned long long)next;
 }
 
 
-// remove the block pointed to by bp
-// from the free list by skipping over it
-static void removeFromList(char* bp)
+// return a monotonic time in milliseconds, which
+// is never 0 so that 0 can mark a purged block
+static uint64_t currentTime(void)
 {
-	unsigned int size = getSize(bp);
-	unsigned int index = getIndex(size);
-	char* nextPtr = getNext(bp);
-	char* prevPtr = getPrev(bp);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
 
-	if( !prevPtr )
-	{
-		array[index] = nextPtr;
-	}
+
+// given a pointer to the first byte in a free block of at
+// least DECAY_MIN_SIZE bytes, return when it was put on its
+// list, or 0 if its pages have been purged since
+static uint64_t getFreedTime(char* bp)
+{
+	return ((struct tree_node*)bp)->freedTime;
+}
+
+
+// given a pointer to the first byte in a free block of at
+// least DECAY_MIN_SIZE bytes, set when it was put on its list
+static void setFreedTime(char* bp, uint64_t time)
+{
+	((struct tree_node*)bp)->freedTime = time;
+}
+
+
+// record that a block ending at end has been allocated.
+// Everything in the arena's newest segment from fresh up to
+// the epilogue has never been used since mem_sbrk first gave
+// it out, so it is still zero, but for the first
+// sizeof(struct tree_node) bytes from fresh and the last 8
+// before the epilogue, where the top free block keeps its
+// links and footer.  Older segments sit below the newest.
+// The caller must hold the arena lock
+static void markUsed(struct arena* arena, char* end)
+{
+	if( end > arena->fresh )
+		arena->fresh = end;
+}
+
+
+// return whether tree node a comes before node b:
+// smaller blocks first, then lower addresses
+static int treeLess(struct tree_node* a, struct tree_node* b)
+{
+	size_t sizeA = getSize((char*)a), sizeB = getSize((char*)b);
+	return sizeA < sizeB || (sizeA == sizeB && a < b);
+}
+
+
+// put v, which may be NULL, where u hangs in the tree
+static void treeReplace(char** root, struct tree_node* u, struct tree_node* v)
+{
+	if( !u->parent )
+		*root = (char*)v;
 	else
-	{
-		setNext(prevPtr, nextPtr);
-	}
-	if( nextPtr )
-	{
-		setPrev(nextPtr, prevPtr);
-	}
+		u->parent->child[u == u->parent->child[1]] = v;
 
-	setNext(bp, NULL);
-	setPrev(bp, NULL);
+	if( v )
+		v->parent = u->parent;
 }
 
 
-/**********************************************************
- * mm_init
- * Initialize the heap to ensure 16 byte alignment,
- * and initialize the free lists to empty
- **********************************************************/
- int mm_init(void)
- {
-	 int i = 0;
-	 for(; i < arrayLength; i++)
-	 {
-		 array[i] = NULL;
-	 }
+// rotate the subtree at x, moving x down on the side
+// dir (0 rotates left) and its other child up
+static void treeRotate(char** root, struct tree_node* x, int dir)
+{
+	struct tree_node* y = x->child[!dir];
 
-	 // want to start heap where it is 8 byte aligned
-	 // but not 16 byte aligned, so that the data section
-	 // of an allocated block will be 16 byte aligned, since
-	 // the header at the front of the block takes 8 bytes
-	 // note: all blocks are multiples of 16 bytes, so
-	 //		  if the first block is aligned properly,
-	 //		  all subsequent blocks will be as well
-	 unsigned long long nextHeapSpot = (unsigned long long)mem_heap_hi() + 1;
-	 while( (nextHeapSpot & 0xF) != 0x8 )
-	 {
-		 mem_sbrk(8);
-		 nextHeapSpot = (unsigned long long)mem_heap_hi() + 1;
-	 }
+	x->child[!dir] = y->child[dir];
+	if( y->child[dir] )
+		y->child[dir]->parent = x;
 
-	 heapStart = (char*) nextHeapSpot;
-	 return 0;
- }
+	treeReplace(root, x, y);
+	y->child[dir] = x;
+	x->parent = y;
+}
 
-/**********************************************************
- * coalesce
- * Covers the 4 cases discussed in the text:
- * - both neighbours are allocated
- * - the next block is available for coalescing
- * - the previous block is available for coalescing
- * - both neighbours are available for coalescing
- *
- * Returns a pointer to the first byte in the largest
- * contiguous free block possible, where the entire
- * block has been remove from all possible free lists
- * and has the correct size set
- **********************************************************/
-void* coalesce(void *bp)
+
+// return the first node of the subtree at node in order
+static struct tree_node* treeFirst(struct tree_node* node)
 {
-	unsigned int size = getSize(bp);
+	if( node )
+		while( node->child[0] )
+			node = node->child[0];
+	return node;
+}
 
-	char* prevFooter = bp - 8;
-	char* nextHeader = bp + size;
 
-	enum Status nextAlloc, prevAlloc;
+// return the last node of the subtree at node in order
+static struct tree_node* treeLast(struct tree_node* node)
+{
+	if( node )
+		while( node->child[1] )
+			node = node->child[1];
+	return node;
+}
 
-	if( mem_heap_hi() == nextHeader - 1 )
-	{
-		// if the next block is outside of the heap,
-		// treat it as allocated and don't check it
-		nextAlloc = ALLOCATED;
-	}
-	else
-	{
-		nextAlloc = getAlloc(nextHeader);
-	}
 
-	if( heapStart == bp )
-	{
-		// if the previous block is below the
-		// start of the heap, treat it as allocated
-		// and don't check it
-		prevAlloc = ALLOCATED;
-	}
-	else
+// return the node after node in order, or NULL
+static struct tree_node* treeNext(struct tree_node* node)
+{
+	if( node->child[1] )
+		return treeFirst(node->child[1]);
+
+	while( node->parent && node == node->parent->child[1] )
+		node = node->parent;
+	return node->parent;
+}
+
+
+// return the smallest node of the tree at node holding at
+// least size bytes, or NULL, counting the nodes looked at
+static struct tree_node* treeFit(struct tree_node* node, size_t size, unsigned int* probes)
+{
+	struct tree_node* best = NULL;
+	while( node )
 	{
-		prevAlloc = getAlloc(prevFooter);
+		(*probes)++;
+		if( getSize((char*)node) >= size )
+		{
+			best = node;
+			node = node->child[0];
+		}
+		else
+			node = node->child[1];
 	}
+	return best;
+}
 
 
-	if( ALLOCATED == prevAlloc && ALLOCATED == nextAlloc )
+// link the free block at bp into the tree at root
+// and restore the red-black properties
+static void treeInsert(char** root, char* bp)
+{
+	struct tree_node* node = (struct tree_node*)bp;
+	struct tree_node* parent = NULL;
+	struct tree_node* iter = (struct tree_node*)*root;
+	int dir = 0;
+
+	while( iter )
 	{
-		return bp;
+		parent = iter;
+		dir = treeLess(iter, node);
+		iter = iter->child[dir];
 	}
-	else if( FREE == prevAlloc && ALLOCATED == nextAlloc )
-	{
-		unsigned int prevSize = getSize(prevFooter);
-		unsigned int totalSize = prevSize + size;
-		char* prevHeader = bp - prevSize;
 
-		// STEP 1: Remove Previous block from respective list
-		removeFromList(prevHeader);
+	node->parent = parent;
+	node->child[0] = node->child[1] = NULL;
+	node->red = 1;
+	if( parent )
+		parent->child[dir] = node;
+	else
+		*root = bp;
 
-		// STEP 2: Set the size in both blocks to the total size
-		setSizeAlloc(prevHeader, totalSize, FREE);
+	// a red node under a red parent: recolour while the
+	// uncle is red too, otherwise rotate once or twice
+	while( (parent = node->parent) && parent->red )
+	{
+		struct tree_node* grand = parent->parent;
+		int side = (parent == grand->child[1]);
+		struct tree_node* uncle = grand->child[!side];
 
-		return prevHeader;
+		if( uncle && uncle->red )
+		{
+			parent->red = 0;
+			uncle->red = 0;
+			grand->red = 1;
+			node = grand;
+			continue;
+		}
+
+		if( node == parent->child[!side] )
+		{
+			treeRotate(root, parent, side);
+			node = parent;
+			parent = node->parent;
+		}
+		parent->red = 0;
+		grand->red = 1;
+		treeRotate(root, grand, !side);
 	}
-	else if( ALLOCATED == prevAlloc && FREE == nextAlloc )
-	{
-		unsigned int nextSize = getSize(nextHeader);
-		unsigned int totalSize = nextSize + size;
 
-		// STEP 1: Remove Next block from respective list
-		removeFromList(nextHeader);
+	((struct tree_node*)*root)->red = 0;
+}
 
-		// STEP 2: Set the size in both blocks to the total size
-		setSizeAlloc(bp, totalSize, FREE);
 
-		return bp;
+// unlink the free block at bp from the tree at root
+// and restore the red-black properties
+static void treeRemove(char** root, char* bp)
+{
+	struct tree_node* z = (struct tree_node*)bp;
+	struct tree_node* x;					// node taking the removed node's place
+	struct tree_node* xParent;
+	int removedRed;
+
+	if( !z->child[0] || !z->child[1] )
+	{
+		x = z->child[0] ? z->child[0] : z->child[1];
+		xParent = z->parent;
+		removedRed = z->red;
+		treeReplace(root, z, x);
 	}
 	else
 	{
-		unsigned int prevSize = getSize(prevFooter);
-		unsigned int nextSize = getSize(nextHeader);
-		unsigned int totalSize = prevSize + size + nextSize;
-		char* prevHeader = bp - prevSize;
-
-		// STEP 1: Remove Previous and Next block from respective list
-		removeFromList(prevHeader);
-		removeFromList(nextHeader);
+		// z has two children, its successor y takes its place
+		struct tree_node* y = treeFirst(z->child[1]);
+		removedRed = y->red;
+		x = y->child[1];
 
-		// STEP 2: Set the size in all three blocks to the total size
-		setSizeAlloc(prevHeader, totalSize, FREE);
+		if( y->parent == z )
+			xParent = y;
+		else
+		{
+			xParent = y->parent;
+			treeReplace(root, y, x);
+			y->child[1] = z->child[1];
+			y->child[1]->parent = y;
+		}
 
-		return prevHeader;
+		treeReplace(root, z, y);
+		y->child[0] = z->child[0];
+		y->child[0]->parent = y;
+		y->red = z->red;
 	}
-}
-
-/**********************************************************
- * extend_heap
- * Extend the heap by one block, where the size of the block
- * corresponds to the largest block allowable in the free list
- * noted by the index passed in
- *
- * returns a pointer to the beginning of the last new block
- * created
- **********************************************************/
-char* extend_heap(unsigned int index)
-{
-	// number of blocks to extend the heap by (for small requests
-	// over extend the heap, to save from calling mem_sbrk too
-	// many times)
-	unsigned int numBlocks = (index < 3) ? 16 : 1;
 
-	unsigned int blockSize = 1 << (index + 5);
+	if( removedRed )
+		return;
 
-    char *bp;
+	// the paths through x are a black node short
+	while( x != (struct tree_node*)*root && (!x || !x->red) )
+	{
+		int side = (x != xParent->child[0]);
+		struct tree_node* w = xParent->child[!side];
 
-    if ( (bp = mem_sbrk(numBlocks * blockSize)) == (void *)-1 )
-        return NULL;
+		if( w->red )
+		{
+			w->red = 0;
+			xParent->red = 1;
+			treeRotate(root, xParent, side);
+			w = xParent->child[!side];
+		}
 
-    array[index] = bp;
+		if( (!w->child[0] || !w->child[0]->red) && (!w->child[1] || !w->child[1]->red) )
+		{
+			w->red = 1;
+			x = xParent;
+			xParent = x->parent;
+			continue;
+		}
 
-    int i = 0;
-    char* iter = bp;
-    char* prevPtr = NULL;
-    for(; i < numBlocks; i++)
-    {
-    	// for each of the numBlocks that we just created,
-    	// set the next and previous pointers to maintain
-    	// the linked list, and set the size/allocated field
-    	setSizeAlloc(iter, blockSize, FREE);
-    	setPrev(iter, prevPtr);
-    	char* nextPtr = ( (numBlocks - 1) == i) ? NULL : iter + blockSize;
-    	setNext(iter, nextPtr);
-    	prevPtr = iter;
-    	iter += blockSize;
-    }
+		if( !w->child[!side] || !w->child[!side]->red )
+		{
+			w->child[side]->red = 0;
+			w->red = 1;
+			treeRotate(root, w, !side);
+			w = xParent->child[!side];
+		}
+		w->red = xParent->red;
+		xParent->red = 0;
+		w->child[!side]->red = 0;
+		treeRotate(root, xParent, side);
+		x = (struct tree_node*)*root;
+	}
 
-    return prevPtr;
+	if( x )
+		x->red = 0;
 }
 
 
-/**********************************************************
- * find_fit
- * Traverse the corresponding free list, searching for a
- * block to fit totalSize
- * Return NULL if no free blocks can handle that size
- **********************************************************/
-void* find_fit(unsigned int totalSize, unsigned int arrayIndex)
+// return the first block of the non-empty list at index:
+// its head, or for a tree the smallest block in it
+static char* binFirst(struct arena* arena, unsigned int index)
 {
-    char* iter = (char*) array[arrayIndex];
-    while( iter && totalSize > getSize(iter) )
-    {
-    	iter = getNext(iter);
-    }
+	if( index < TREE_MIN_INDEX )
+		return arena->array[index];
 
-    // Can either be NULL, if no suitable block found
-    // or a pointer to the suitable block
-    return iter;
+	return (char*)treeFirst((struct tree_node*)arena->array[index]);
 }
 
+
+// remove the block pointed to by bp
+// from the free list by skipping over it,
+// or from the tree holding it
+static void removeFromList(struct arena* arena, char* bp)
+{
+	size_t size = getSize(bp);
+	unsigned int index = getIndex(size);
+
+	arena->stats.freeBlocks[index]--;
+	arena->stats.freeBytes[index] -= size;
+
+	if( index >= TREE_MIN_INDEX )
+	{
+		treeRemove(&arena->array[index], bp);
+		if( !arena->array[index] )
+			clearBin(arena, index);
+		return;
+	}
+
+	char* nextPtr = getNext(bp);
+	char* prevPtr = getPrev(bp);
+
+	if( !prevPtr )
+	{
+		arena->array[index] = nextPtr;
+		if( !nextPtr )
+			clearBin(arena, index);
+	}
+	else
+	{
+		setNext(prevPtr, nextPtr);
+	}
+	if( nextPtr )
+	{
+		setPrev(nextPtr, prevPtr);
+	}
+
+	setNext(bp, NULL);
+	setPrev(bp, NULL);
+}
+
+
+// insert the free block pointed to by bp at the
+// front of its free list, or into its tree, without
+// coalescing
+static void addToList(struct arena* arena, char* bp)
+{
+	size_t size = getSize(bp);
+	unsigned int index = getIndex(size);
+	char* oldHead = arena->array[index];
+
+	if( size >= DECAY_MIN_SIZE )
+		setFreedTime(bp, currentTime());
+
+	arena->stats.freeBlocks[index]++;
+	arena->stats.freeBytes[index] += size;
+
+	if( index >= TREE_MIN_INDEX )
+	{
+		treeInsert(&arena->array[index], bp);
+		setBin(arena, index);
+		return;
+	}
+
+	setPrev(bp, NULL);
+	setNext(bp, oldHead);
+	if( oldHead )
+		setPrev(oldHead, bp);
+
+	arena->array[index] = bp;
+	setBin(arena, index);
+}
+
+
+// round a byte count up to a whole number of pages
+static size_t pageRoundUp(size_t bytes)
+{
+	return (bytes + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1);
+}
+
+
+// round a byte count up to a whole number of chunks, the
+// pages or huge pages the heap is grown and trimmed in
+static size_t chunkRoundUp(size_t bytes)
+{
+	return (bytes + chunkBytes - 1) & ~(chunkBytes - 1);
+}
+
+
+// return the page map entry for the byte pointed to by p
+static uintptr_t* getPageEntry(void* p)
+{
+	uintptr_t page = (uintptr_t)p >> PAGE_SHIFT;
+	uintptr_t* leaf = pagemap[page >> PAGEMAP_LEAF_BITS];
+
+	// pages outside the heap, like those of mapped
+	// blocks, may not have a leaf at all
+	if( !leaf )
+		return &unmappedPage;
+
+	return &leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+}
+
+
+// return the segment holding the byte pointed to by p
+static struct segment* getSegment(void* p)
+{
+	return (struct segment*)(*getPageEntry(p) & ~(uintptr_t)RUN_PAGE);
+}
+
+
+// return whether the byte pointed to by p
+// is on a page used as a slab run
+static int isRunPage(void* p)
+{
+	return *getPageEntry(p) & RUN_PAGE;
+}
+
+
+// record that the pages in [start, start + bytes) belong to seg,
+// mapping any missing page map leaves.  The caller must hold sbrkLock
+static int setSegment(char* start, size_t bytes, struct segment* seg)
+{
+	uintptr_t page = (uintptr_t)start >> PAGE_SHIFT;
+	uintptr_t lastPage = ((uintptr_t)start + bytes - 1) >> PAGE_SHIFT;
+
+	for(; page <= lastPage; page++)
+	{
+		uintptr_t** leaf = &pagemap[page >> PAGEMAP_LEAF_BITS];
+		if( !*leaf )
+		{
+			void* map = mmap(NULL, sizeof(uintptr_t) << PAGEMAP_LEAF_BITS,
+							 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if( MAP_FAILED == map )
+				return -1;
+			*leaf = map;
+		}
+		(*leaf)[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] = (uintptr_t)seg;
+	}
+
+	return 0;
+}
+
+
+// return the arena owning the block or slab
+// object whose data section is pointed to by bp
+static struct arena* getArena(void* bp)
+{
+	return getSegment(bp)->arena;
+}
+
+
+// empty every free list, quick-list and run list of the
+// arena, and forget its segments and counters
+static void clear_arena(struct arena* arena)
+{
+	arena->remote = NULL;
+	arena->segments = NULL;
+	memset(arena->runs, 0, sizeof(arena->runs));
+	memset(arena->quick, 0, sizeof(arena->quick));
+	memset(arena->quickCount, 0, sizeof(arena->quickCount));
+	arena->quickBlocks = 0;
+	memset(arena->binmap, 0, sizeof(arena->binmap));
+	arena->binSummary = 0;
+	arena->lastDecay = 0;
+	arena->lastGrow = 0;
+	arena->growSize = 0;
+	arena->fresh = NULL;
+	arena->freshStart = NULL;
+	memset(&arena->stats, 0, sizeof(arena->stats));
+
+	unsigned int i = 0;
+	for(; i < arrayLength; i++)
+	{
+		arena->array[i] = NULL;
+	}
+}
+
+
+/**********************************************************
+ * mm_init
+ * Align the break to a chunk boundary, a page or a huge page
+ * (see mm_set_huge_pages), so that every segment starts on
+ * one, and initialize every arena to have empty free lists
+ * and no segments
+ **********************************************************/
+ int mm_init(void)
+ {
+	 numArenas = configuredArenas;
+	 if( 0 == numArenas )
+	 {
+		 long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		 numArenas = (cpus < 1) ? 1 : (unsigned int)cpus;
+	 }
+	 if( numArenas > MAX_ARENAS )
+		 numArenas = MAX_ARENAS;
+
+	 assert(getIndex(TREE_MIN_SIZE) == TREE_MIN_INDEX);
+
+	 unsigned int a = 0;
+	 for(; a < MAX_ARENAS; a++)
+	 {
+		 pthread_mutex_init(&arenas[a].lock, NULL);
+		 clear_arena(&arenas[a]);
+		 arenas[a].heap = NULL;
+		 arenas[a].index = a;
+	 }
+
+	 // blocks cached by any thread belong to the old heap
+	 heapGeneration++;
+	 memset(&purgeStats, 0, sizeof(purgeStats));
+	 sbrkCalls = 0;
+	 mappedBytes = 0;
+	 mappedBlocks = 0;
+	 profile_reset();
+
+	 chunkBytes = hugePages ? HUGE_PAGE_BYTES : PAGE_BYTES;
+
+	 // want to start the first segment on a chunk boundary,
+	 // the segment header then leaves the first block header
+	 // 8 byte aligned but not 16 byte aligned, so that the
+	 // data section of an allocated block will be 16 byte
+	 // aligned, since the header at the front of the block
+	 // takes 8 bytes
+	 // note: all blocks and segments are multiples of 16 bytes,
+	 //		  so if the first block is aligned properly,
+	 //		  all subsequent blocks will be as well
+	 uintptr_t nextHeapSpot = (uintptr_t)mem_heap_hi() + 1;
+	 size_t padding = chunkRoundUp(nextHeapSpot) - nextHeapSpot;
+	 if( padding && (void*)-1 == mem_sbrk(padding) )
+		 return -1;
+	 sbrkCalls += (0 != padding);
+
+	 return 0;
+ }
+
+
+/**********************************************************
+ * mm_set_arenas
+ * Choose how many arenas the next mm_init creates (0 means
+ * one per online CPU) and how threads are assigned to them
+ **********************************************************/
+void mm_set_arenas(unsigned int count, int policy)
+{
+	configuredArenas = count;
+	arenaPolicy = policy;
+}
+
+/**********************************************************
+ * coalesce
+ * Covers the 4 cases discussed in the text:
+ * - both neighbours are allocated
+ * - the next block is available for coalescing
+ * - the previous block is available for coalescing
+ * - both neighbours are available for coalescing
+ *
+ * Returns a pointer to the first byte in the largest
+ * contiguous free block possible, where the entire
+ * block has been remove from all possible free lists
+ * and has the correct size set
+ **********************************************************/
+static void* coalesce(struct arena* arena, void *bp)
+{
+	size_t size = getSize(bp);
+
+	char* prevFooter = bp - 8;
+	char* nextHeader = bp + size;
+
+	// the prologue and epilogue of the segment are marked
+	// allocated, so the neighbours never need a bounds check.
+	// The previous block only has a footer to read when
+	// the header says it is free
+	enum Status nextAlloc = getAlloc(nextHeader);
+	enum Status prevAlloc = getPrevAlloc(bp);
+
+
+	if( ALLOCATED == prevAlloc && ALLOCATED == nextAlloc )
+	{
+		return bp;
+	}
+	else if( FREE == prevAlloc && ALLOCATED == nextAlloc )
+	{
+		size_t prevSize = getSize(prevFooter);
+		size_t totalSize = prevSize + size;
+		char* prevHeader = bp - prevSize;
+
+		// STEP 1: Remove Previous block from respective list
+		removeFromList(arena, prevHeader);
+		arena->stats.coalesces++;
+
+		// STEP 2: Set the size in both blocks to the total size
+		setSizeAlloc(prevHeader, totalSize, FREE);
+
+		return prevHeader;
+	}
+	else if( ALLOCATED == prevAlloc && FREE == nextAlloc )
+	{
+		size_t nextSize = getSize(nextHeader);
+		size_t totalSize = nextSize + size;
+
+		// STEP 1: Remove Next block from respective list
+		removeFromList(arena, nextHeader);
+		arena->stats.coalesces++;
+
+		// STEP 2: Set the size in both blocks to the total size
+		setSizeAlloc(bp, totalSize, FREE);
+
+		return bp;
+	}
+	else
+	{
+		size_t prevSize = getSize(prevFooter);
+		size_t nextSize = getSize(nextHeader);
+		size_t totalSize = prevSize + size + nextSize;
+		char* prevHeader = bp - prevSize;
+
+		// STEP 1: Remove Previous and Next block from respective list
+		removeFromList(arena, prevHeader);
+		removeFromList(arena, nextHeader);
+		arena->stats.coalesces += 2;
+
+		// STEP 2: Set the size in all three blocks to the total size
+		setSizeAlloc(prevHeader, totalSize, FREE);
+
+		return prevHeader;
+	}
+}
+
+// ask for transparent huge pages behind memory just taken
+// from mem_sbrk, whole huge pages since the break moves in
+// chunks of them while they are on
+static void adviseHuge(char* start, size_t bytes)
+{
+	if( HUGE_PAGE_BYTES == chunkBytes )
+		madvise(start, bytes, MADV_HUGEPAGE);
+}
+
+
+// move the break on by room bytes to grow seg in place, as
+// long as seg still ends at the break.  The new room starts
+// at the old epilogue header.  returns 0 on success
+// The caller must hold sbrkLock
+static int extend_segment(struct segment* seg, size_t room)
+{
+	char* heapEnd = (char*)mem_heap_hi() + 1;
+	if( (char*)seg + seg->size != heapEnd )
+		return -1;
+
+	sbrkCalls++;
+	if( (void*)-1 == mem_sbrk(room) || setSegment(heapEnd, room, seg) )
+		return -1;
+	adviseHuge(heapEnd, room);
+
+	seg->size += room;
+	if( heapEnd + room > highWater )
+		highWater = heapEnd + room;
+	return 0;
+}
+
+
+/**********************************************************
+ * grow_arena
+ * Find room for at least bytes more bytes of blocks in the
+ * arena, either by moving the break past the newest segment
+ * when it is still the last thing on the heap, or by
+ * starting a new segment of at least SEGMENT_MIN_SIZE bytes.
+ * A private heap maps each new segment instead, at least
+ * twice the size of the last up to HEAP_SEGMENT_MAX, so
+ * there are few of them to unmap
+ *
+ * bytes is updated to the room actually added, whole chunks
+ * when the segment grew, or all of a new segment
+ *
+ * returns a pointer to the header of the new room, which
+ * holds the previous block bit for it, or NULL if mem_sbrk
+ * fails
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static char* grow_arena(struct arena* arena, size_t* bytes)
+{
+	struct segment* seg = arena->segments;
+	char* bp;
+	size_t room;
+
+	pthread_mutex_lock(&sbrkLock);
+
+	room = chunkRoundUp(*bytes);
+	if( seg && !arena->heap && 0 == extend_segment(seg, room) )
+	{
+		// the new room starts where the epilogue was
+		bp = (char*)seg + seg->size - room - 8;
+	}
+	else
+	{
+		size_t segSize = pageRoundUp(*bytes + SEGMENT_OVERHEAD);
+		if( segSize < SEGMENT_MIN_SIZE )
+			segSize = SEGMENT_MIN_SIZE;
+
+		if( arena->heap )
+		{
+			size_t doubled = seg ? 2 * seg->size : 0;
+			if( doubled > HEAP_SEGMENT_MAX )
+				doubled = HEAP_SEGMENT_MAX;
+			if( segSize < doubled )
+				segSize = doubled;
+
+			seg = mmap(NULL, segSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+		else
+		{
+			segSize = chunkRoundUp(segSize);
+			sbrkCalls++;
+			seg = mem_sbrk(segSize);
+			if( (void*)-1 != (void*)seg )
+				adviseHuge((char*)seg, segSize);
+		}
+		room = segSize - SEGMENT_OVERHEAD;
+
+		// MAP_FAILED is (void*)-1 as well
+		if( (void*)-1 == (void*)seg || setSegment((char*)seg, segSize, seg) )
+		{
+			pthread_mutex_unlock(&sbrkLock);
+			return NULL;
+		}
+
+		seg->arena = arena;
+		seg->next = arena->segments;
+		seg->size = segSize;
+		seg->prologue[0] = 16 | PREV_ALLOCATED | 1;
+		seg->prologue[1] = 16 | PREV_ALLOCATED | 1;
+		arena->segments = seg;
+		bp = (char*)(seg + 1);
+		*(uintptr_t*)bp = PREV_ALLOCATED;
+
+		// a heap that was reset hands out used memory again,
+		// while a mapping is always new
+		arena->freshStart = (highWater > bp && !arena->heap) ? highWater : bp;
+		arena->fresh = arena->freshStart;
+		if( (char*)seg + segSize > highWater && !arena->heap )
+			highWater = (char*)seg + segSize;
+	}
+
+	pthread_mutex_unlock(&sbrkLock);
+
+	// new epilogue header, the block before it is free
+	*(uintptr_t*)((char*)seg + seg->size - 8) = 0 | 1;
+
+	*bytes = room;
+	return bp;
+}
+
+/**********************************************************
+ * extend_heap
+ * Grow the arena so that one free block of at least
+ * blockSize bytes sits at the top of its newest segment
+ *
+ * When the segment already ends in a free block, the
+ * wilderness, and still ends at the break, only what that
+ * block is missing is added to it.  On top of that, an
+ * arena that keeps running out within GROW_INTERVAL ms of
+ * the last time gets headroom that doubles each time, up
+ * to an eighth of the arena or GROW_MAX_SIZE, so a growing
+ * heap calls mem_sbrk a logarithmic number of times, while
+ * one that rarely grows is left with less than a page of
+ * slack
+ *
+ * returns a pointer to the free block, which is on its
+ * free list, or NULL if mem_sbrk fails
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static char* extend_heap(struct arena* arena, size_t blockSize)
+{
+	struct segment* seg = arena->segments;
+	char* wild = NULL;
+	size_t wildSize = 0;
+
+	if( seg )
+	{
+		char* epilogue = (char*)seg + seg->size - 8;
+		if( FREE == getPrevAlloc(epilogue) )
+		{
+			wildSize = getSize(epilogue - 8);
+			wild = epilogue - wildSize;
+		}
+	}
+
+	// allocate() would have found a wilderness this big
+	if( wildSize >= blockSize )
+		return wild;
+
+	// headroom doubles each time the arena runs out again
+	// soon after the last time, and is dropped once it has not
+	uint64_t now = currentTime();
+	if( now - arena->lastGrow < GROW_INTERVAL )
+	{
+		size_t limit = 0;
+		for(; seg; seg = seg->next)
+			limit += seg->size / 8;
+		if( limit > GROW_MAX_SIZE )
+			limit = GROW_MAX_SIZE;
+
+		arena->growSize = arena->growSize ? 2 * arena->growSize : PAGE_BYTES;
+		if( arena->growSize > limit )
+			arena->growSize = limit;
+	}
+	else
+		arena->growSize = 0;
+	arena->lastGrow = now;
+	size_t headroom = arena->growSize;
+	arena->stats.extends++;
+
+	if( wild && !arena->heap )
+	{
+		// grow the wilderness in place
+		size_t room = chunkRoundUp(blockSize - wildSize + headroom);
+		seg = arena->segments;
+
+		pthread_mutex_lock(&sbrkLock);
+		int grown = extend_segment(seg, room);
+		pthread_mutex_unlock(&sbrkLock);
+
+		if( 0 == grown )
+		{
+			// the old footer and epilogue would be left in
+			// the middle of memory known to be zero
+			removeFromList(arena, wild);
+			memset(wild + wildSize - 8, 0, 16);
+			setSizeAlloc(wild, wildSize + room, FREE);
+			*(uintptr_t*)(wild + wildSize + room) = 0 | 1;
+			addToList(arena, wild);
+			return wild;
+		}
+
+		// another arena has moved the break on, the
+		// wilderness stays behind in its segment
+	}
+
+	size_t room = blockSize + headroom;
+	char* bp = grow_arena(arena, &room);
+	if( !bp )
+		return NULL;
+
+	setSizeAlloc(bp, room, FREE);
+	addToList(arena, bp);
+	return bp;
+}
+
+
+// add one search that looked at probes blocks to the
+// histogram: bucket 0 for no probes, 1 for one, then one
+// per power of two: 2, 3-4, 5-8, ...
+static void countProbes(struct arena* arena, unsigned int probes)
+{
+    unsigned int bucket = probes;
+    if( probes > 1 )
+    	bucket = 65 - __builtin_clzll(probes - 1);
+    arena->stats.probes[bucket < PROBE_BUCKETS ? bucket : PROBE_BUCKETS - 1]++;
+}
+
+
+/**********************************************************
+ * find_fit
+ * Traverse the corresponding free list, searching for a
+ * block to fit totalSize
+ * Return NULL if no free blocks can handle that size
+ **********************************************************/
+static void* find_fit(struct arena* arena, size_t totalSize, unsigned int arrayIndex)
+{
+    char* iter = (char*) arena->array[arrayIndex];
+    unsigned int probes = 0;
+    while( iter )
+    {
+    	// the next block's line is on its way while this
+    	// one's size is compared
+    	char* next = getNext(iter);
+    	__builtin_prefetch(next);
+    	if( totalSize <= getSize(iter) )
+    		break;
+
+    	iter = next;
+    	probes++;
+    }
+
+    countProbes(arena, probes);
+
+    // Can either be NULL, if no suitable block found
+    // or a pointer to the suitable block
+    return iter;
+}
+
+
+/**********************************************************
+ * tree_fit
+ * Find the best fit for totalSize among the blocks of at
+ * least TREE_MIN_SIZE bytes: the smallest block that fits
+ * in the tree at index, or failing that the smallest block
+ * in the next non-empty tree, the lowest address winning
+ * between blocks of the same size
+ * Return NULL if no free blocks can handle that size
+ **********************************************************/
+static char* tree_fit(struct arena* arena, size_t totalSize, unsigned int index)
+{
+	unsigned int probes = 0;
+	struct tree_node* node = treeFit((struct tree_node*)arena->array[index], totalSize, &probes);
+
+	if( !node )
+	{
+		index = findBin(arena, index + 1);
+		if( index < LIST_COUNT )
+			node = treeFirst((struct tree_node*)arena->array[index]);
+	}
+
+	countProbes(arena, probes);
+	return (char*)node;
+}
+
+/**********************************************************
+ * place
+ * Given a block in a free list, we want to prepare this
+ * block to be returned by mm_malloc
+ *
+ * Remove the block from its free list, set it to allocated,
+ * clear the next/previous pointers, and return a pointer
+ * to just the data portion (skip the header)
+ *
+ * If their is enough unneeded space in the chosen block
+ * to make a new block, split the two blocks, and "free"
+ * the unused portion so that it is stored appropriately
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static char* place(struct arena* arena, char* bp, size_t totalSizeNeeded, unsigned int arrayIndex)
+{
+	// marks the current block as allocated
+	// returns a pointer to the data section of this block
+
+	size_t blockSize = getSize(bp);
+
+	// STEP 1: remove from list
+	removeFromList(arena, bp);
+
+	if( totalSizeNeeded + 32 <= blockSize )
+	{
+		arena->stats.splits++;
+
+		// then we split it up and free
+		size_t extraSize = blockSize - totalSizeNeeded;
+		blockSize = totalSizeNeeded;
+
+		char* toFree = bp + blockSize;
+		*(uintptr_t*)toFree = PREV_ALLOCATED;
+		setSizeAlloc(toFree, extraSize, ALLOCATED);
+		setSizeAlloc(bp, blockSize, ALLOCATED);
+
+		setNext(bp, NULL);
+		setPrev(bp, NULL);
+		setNext(toFree, NULL);
+		setPrev(toFree, NULL);
+
+		// free the portion of the block that
+		// isn't needed
+		free_block(arena, toFree + 8);
+	}
+	else
+	{
+		// STEP 2: clear pointer fields in block, set to allocated
+		setSizeAlloc(bp, blockSize, ALLOCATED);
+		setNext(bp, NULL);
+		setPrev(bp, NULL);
+		setPrevAlloc(bp + blockSize, ALLOCATED);
+	}
+
+	markUsed(arena, bp + blockSize);
+
+	// STEP 3: return pointer to data segment only
+	return bp + 8;
+}
+
+/**********************************************************
+ * free_block
+ * Coalesce the block with its neighbouring blocks, and
+ * insert it at the beginning of appropriate free list
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void free_block(struct arena* arena, void *bp)
+{
+    char* blockPointer = (char*)bp - 8;
+
+    // call coalesce, block pointer may now point to header of bigger block
+    blockPointer = coalesce(arena, blockPointer);
+
+    size_t blockSize = getSize(blockPointer);
+    setSizeAlloc(blockPointer, blockSize, FREE);
+    setPrevAlloc(blockPointer + blockSize, FREE);
+
+    addToList(arena, blockPointer);
+
+    if( blockSize >= DECAY_MIN_SIZE )
+        decay_arena(arena, 0);
+}
+
+
+
+/**********************************************************
+ * shrink_block
+ * Cut the allocated block at bp down to totalSize bytes,
+ * and free the tail when it is big enough to be a block of
+ * its own.  The block after bp must be marked as having an
+ * allocated block before it
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void shrink_block(struct arena* arena, char* bp, size_t totalSize)
+{
+	size_t blockSize = getSize(bp);
+	if( blockSize - totalSize < MIN_BLOCK_SIZE )
+		return;
+
+	arena->stats.splits++;
+	char* tail = bp + totalSize;
+	*(uintptr_t*)tail = PREV_ALLOCATED;
+	setSizeAlloc(tail, blockSize - totalSize, ALLOCATED);
+	setSizeAlloc(bp, totalSize, ALLOCATED);
+
+	free_block(arena, tail + 8);
+}
+
+
+/**********************************************************
+ * resize_block
+ * Resize the allocated block at bp to totalSize bytes
+ * without moving its data.  A shrinking block gives back
+ * its tail once that is more than a quarter of the block,
+ * so headroom left by an earlier move is kept; a growing
+ * block takes in the free block after it, and when that
+ * still falls short but the block is the last one of a
+ * segment that ends at the break, the break is moved on to
+ * make up the difference
+ *
+ * returns 0 if the block was resized, or -1 if the data
+ * has to move
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static int resize_block(struct arena* arena, char* bp, size_t totalSize)
+{
+	size_t blockSize = getSize(bp);
+	// a block keeps up to a quarter of itself as headroom
+	if( totalSize <= blockSize )
+	{
+		if( blockSize - totalSize > blockSize / 4 )
+			shrink_block(arena, bp, totalSize);
+		return 0;
+	}
+
+	char* next = bp + blockSize;
+	int nextFree = !getAlloc(next);
+	size_t available = blockSize;
+	if( nextFree )
+		available += getSize(next);
+
+	if( available >= totalSize )
+	{
+		removeFromList(arena, next);
+		setSizeAlloc(bp, available, ALLOCATED);
+		setPrevAlloc(bp + available, ALLOCATED);
+		markUsed(arena, bp + available);
+		shrink_block(arena, bp, totalSize);
+		return 0;
+	}
+
+	// only the epilogue has a size of 0
+	if( 0 != getSize(bp + available) )
+		return -1;
+
+	size_t room = chunkRoundUp(totalSize - available);
+
+	pthread_mutex_lock(&sbrkLock);
+	int extended = extend_segment(getSegment(bp), room);
+	pthread_mutex_unlock(&sbrkLock);
+
+	if( extended < 0 )
+		return -1;
+
+	if( nextFree )
+		removeFromList(arena, next);
+
+	available += room;
+	setSizeAlloc(bp, available, ALLOCATED);
+	*(uintptr_t*)(bp + available) = PREV_ALLOCATED | 1;
+	markUsed(arena, bp + available);
+	shrink_block(arena, bp, totalSize);
+	return 0;
+}
+
+/**********************************************************
+ * QUICK-LISTS
+ **********************************************************/
+
+
+// given a heap block size, return the quick-list holding
+// blocks of that size, or QUICK_CLASSES if none does
+static unsigned int quickIndex(size_t blockSize)
+{
+	if( blockSize <= SLAB_MAX_SIZE || blockSize > QUICK_MAX_SIZE )
+		return QUICK_CLASSES;
+
+	return (blockSize - SLAB_MAX_SIZE) / 16 - 1;
+}
+
+
+// given the data pointer of a block on a quick-list,
+// return the data pointer of the block after it
+static char* quickGetNext(char* data)
+{
+	return *(char**)data;
+}
+
+
+// given the data pointer of a block on a quick-list,
+// set the data pointer of the block after it
+static void quickSetNext(char* data, char* next)
+{
+	*(char**)data = next;
+}
+
+
+/**********************************************************
+ * consolidate
+ * Empty every quick-list of the arena, freeing each block
+ * properly so that it coalesces with its neighbours
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void consolidate(struct arena* arena)
+{
+	unsigned int i = 0;
+	for(; i < QUICK_CLASSES && arena->quickBlocks; i++)
+	{
+		char* data = arena->quick[i];
+		while( data )
+		{
+			char* next = quickGetNext(data);
+			__builtin_prefetch(next, 1);
+			free_block(arena, data);
+			data = next;
+		}
+
+		arena->quickBlocks -= arena->quickCount[i];
+		arena->quick[i] = NULL;
+		arena->quickCount[i] = 0;
+	}
+}
+
+
+/**********************************************************
+ * quick_free
+ * Put the block on the quick-list for its exact size
+ * instead of coalescing it.  The block stays marked as
+ * allocated, so coalesce never merges it and the next
+ * request of the same size takes it back without any
+ * splitting.  A quick-list that grows past quickLimit
+ * consolidates the arena
+ *
+ * returns 0 if the block is not kept on a quick-list
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static int quick_free(struct arena* arena, char* data)
+{
+	unsigned int index = quickIndex(getSize(data - 8));
+	if( index >= QUICK_CLASSES || 0 == quickLimit )
+		return 0;
+
+	quickSetNext(data, arena->quick[index]);
+	arena->quick[index] = data;
+	arena->quickBlocks++;
+
+	if( ++arena->quickCount[index] > quickLimit )
+		consolidate(arena);
+
+	return 1;
+}
+
+
+/**********************************************************
+ * mm_set_quick_limit
+ * Set how many blocks of one size an arena may keep on its
+ * quick-list before consolidating.  0 frees every block
+ * straight away, with full coalescing
+ **********************************************************/
+void mm_set_quick_limit(unsigned int blocks)
+{
+	quickLimit = blocks;
+}
+
+/**********************************************************
+ * allocate
+ * Determine the first free list where every block fits the
+ * block size, and use the bitmap of non-empty lists to find
+ * the first non-empty list at or above it in O(1).  Only
+ * when all of those are empty is the request's own list,
+ * which may hold blocks a little too small, searched for
+ * the first block that fits
+ *
+ * If a fit is found, the block is prepared by place()
+ *
+ * If no fit is found in any of the lists, the heap is
+ * extended to meet the request
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void* allocate(struct arena* arena, size_t totalSize)
+{
+    unsigned int arrayIndex = getIndex(totalSize);  // find appropriate list index for size
+    unsigned int fitIndex = getFitIndex(totalSize);	// first list where every block fits
+
+    // a block of exactly this size that was freed
+    // without coalescing is already allocated
+    unsigned int quick = quickIndex(totalSize);
+    if( quick < QUICK_CLASSES && arena->quick[quick] )
+    {
+    	char* data = arena->quick[quick];
+    	arena->quick[quick] = quickGetNext(data);
+    	arena->quickCount[quick]--;
+    	arena->quickBlocks--;
+    	return data;
+    }
+
+    char* bp;
+    if( arrayIndex >= TREE_MIN_INDEX )
+    {
+    	// large blocks are searched for the best fit
+    	bp = tree_fit(arena, totalSize, arrayIndex);
+    	if( bp )
+    		return place(arena, bp, totalSize, arrayIndex);
+    }
+    else
+    {
+    	// STEP 0: first non-empty list where any
+    	//		   block is guaranteed to fit
+    	unsigned int index = findBin(arena, fitIndex);
+    	if( index < LIST_COUNT )
+    	{
+    		return place(arena, binFirst(arena, index), totalSize, index);
+    	}
+    }
+
+    // STEP 1: search the request's own list, unless
+    //		   it was already covered by step 0
+    if( arrayIndex != fitIndex && arrayIndex < TREE_MIN_INDEX )
+    {
+    	bp = find_fit(arena, totalSize, arrayIndex);
+    	if ( bp )
+    	{
+    		return place(arena, bp, totalSize, arrayIndex);
+    	}
+    }
+
+    // we couldn't find any blocks that fit, but
+    // the quick-lists may coalesce into one
+    if( arena->quickBlocks )
+    {
+    	consolidate(arena);
+    	return allocate(arena, totalSize);
+    }
+
+    // just force allocate for this request
+
+    // STEP 2: Call extend heap, which grows the free
+    //		   block at the top of the heap to fit
+    bp = extend_heap(arena, totalSize);
+    if( !bp )
+    	return NULL;
+
+    // STEP 3: place the request at the start of it
+    return place(arena, bp, totalSize, arrayIndex);
+}
+
+/**********************************************************
+ * allocate_aligned
+ * Allocate a block of totalSize bytes whose data section
+ * starts on a multiple of align, a power of two above 16
+ *
+ * Enough extra is requested from allocate() that the slack
+ * in front of the aligned data can always become a free
+ * block of its own, and any space left over at the end is
+ * split off and freed as well, so nothing is wasted
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void* allocate_aligned(struct arena* arena, size_t totalSize, size_t align)
+{
+	char* data = allocate(arena, totalSize + align + MIN_BLOCK_SIZE);
+	if( !data )
+		return NULL;
+
+	char* bp = data - 8;
+	size_t blockSize = getSize(bp);
+
+	uintptr_t aligned = ((uintptr_t)data + align - 1) & ~(uintptr_t)(align - 1);
+	if( aligned != (uintptr_t)data && aligned - (uintptr_t)data < MIN_BLOCK_SIZE )
+		aligned += align;
+
+	size_t lead = aligned - (uintptr_t)data;
+	if( lead )
+	{
+		// the leading slack keeps the header (and previous
+		// block bit) of the original block, and is freed
+		// so it can coalesce with the block before it
+		char* alignedBp = bp + lead;
+		arena->stats.splits++;
+		*(uintptr_t*)alignedBp = PREV_ALLOCATED;
+		setSizeAlloc(alignedBp, blockSize - lead, ALLOCATED);
+		setSizeAlloc(bp, lead, ALLOCATED);
+		free_block(arena, bp + 8);
+
+		bp = alignedBp;
+		blockSize -= lead;
+	}
+
+	if( totalSize + MIN_BLOCK_SIZE <= blockSize )
+	{
+		char* toFree = bp + totalSize;
+		arena->stats.splits++;
+		*(uintptr_t*)toFree = PREV_ALLOCATED;
+		setSizeAlloc(toFree, blockSize - totalSize, ALLOCATED);
+		setSizeAlloc(bp, totalSize, ALLOCATED);
+		free_block(arena, toFree + 8);
+	}
+
+	return bp + 8;
+}
+
+/**********************************************************
+ * SLAB RUNS
+ **********************************************************/
+
+_Static_assert(sizeof(struct run) <= RUN_HEADER_SIZE, "struct run must fit in RUN_HEADER_SIZE");
+
+
+// given a request size no larger than SLAB_MAX_SIZE,
+// return the slab class serving it
+static unsigned int slabClass(size_t size)
+{
+	return (size + 15) / 16 - 1;
+}
+
+
+// given a slab class, return the size of its objects
+static unsigned int slabObjectSize(unsigned int sizeClass)
+{
+	return (sizeClass + 1) * 16;
+}
+
+
+// given a pointer to a slab object, return its run
+static struct run* getRun(void* bp)
+{
+	return (struct run*)((uintptr_t)bp & ~(PAGE_BYTES - 1));
+}
+
+
+// push a run onto the front of its class's list of
+// runs with free slots
+static void addRun(struct arena* arena, struct run* run)
+{
+	struct run* oldHead = arena->runs[run->sizeClass];
+
+	run->prev = NULL;
+	run->next = oldHead;
+	if( oldHead )
+		oldHead->prev = run;
+
+	arena->runs[run->sizeClass] = run;
+}
+
+
+// unlink a run from its class's list of runs with free slots
+static void removeRun(struct arena* arena, struct run* run)
+{
+	if( run->prev )
+		run->prev->next = run->next;
+	else
+		arena->runs[run->sizeClass] = run->next;
+
+	if( run->next )
+		run->next->prev = run->prev;
+
+	run->next = NULL;
+	run->prev = NULL;
+}
+
+
+/**********************************************************
+ * new_run
+ * Carve a page aligned run for the given class out of the
+ * arena's heap, mark every slot free and flag its page in
+ * the page map so mm_free can recognise its objects
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static struct run* new_run(struct arena* arena, unsigned int sizeClass)
+{
+	struct run* run = allocate_aligned(arena, RUN_BLOCK_SIZE, PAGE_BYTES);
+	if( !run )
+		return NULL;
+
+	unsigned int capacity = (PAGE_BYTES - RUN_HEADER_SIZE) / slabObjectSize(sizeClass);
+
+	memset(run, 0, sizeof(struct run));
+	run->sizeClass = sizeClass;
+	run->freeCount = capacity;
+	run->capacity = capacity;
+
+	unsigned int i = 0;
+	for(; i < capacity / 64; i++)
+		run->bitmap[i] = ~0ULL;
+	if( capacity % 64 )
+		run->bitmap[i] = (1ULL << (capacity % 64)) - 1;
+
+	*getPageEntry(run) |= RUN_PAGE;
+	addRun(arena, run);
+
+	return run;
+}
+
+
+/**********************************************************
+ * slab_allocate
+ * Hand out the lowest free slot of the first run of the
+ * class with room, starting a new run if there is none
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void* slab_allocate(struct arena* arena, unsigned int sizeClass)
+{
+	struct run* run = arena->runs[sizeClass];
+	if( !run )
+	{
+		run = new_run(arena, sizeClass);
+		if( !run )
+			return NULL;
+	}
+
+	unsigned int word = 0;
+	while( 0 == run->bitmap[word] )
+		word++;
+
+	unsigned int bit = __builtin_ctzll(run->bitmap[word]);
+	run->bitmap[word] &= run->bitmap[word] - 1;
+
+	if( 0 == --run->freeCount )
+		removeRun(arena, run);
+
+	unsigned int slot = word * 64 + bit;
+	return (char*)run + RUN_HEADER_SIZE + slot * slabObjectSize(sizeClass);
+}
+
+
+/**********************************************************
+ * slab_free
+ * Mark the object's slot free again.  A run that becomes
+ * empty is given back to the heap, unless it is the only
+ * run of its class with free slots
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void slab_free(struct arena* arena, void* bp)
+{
+	struct run* run = getRun(bp);
+	unsigned int slot = ((char*)bp - (char*)run - RUN_HEADER_SIZE) / slabObjectSize(run->sizeClass);
+
+	run->bitmap[slot / 64] |= 1ULL << (slot % 64);
+
+	if( 1 == ++run->freeCount )
+		addRun(arena, run);
+
+	if( run->freeCount == run->capacity && (run->next || run->prev) )
+	{
+		removeRun(arena, run);
+		*getPageEntry(run) &= ~(uintptr_t)RUN_PAGE;
+		free_block(arena, run);
+	}
+}
+
+
+// allocate size bytes from the arena, from a slab
+// run for small sizes and a heap block otherwise.
+// The caller must hold the arena lock
+static void* arena_malloc(struct arena* arena, size_t size)
+{
+	if( size <= SLAB_MAX_SIZE )
+	{
+		arena->stats.slabAllocs[slabClass(size)]++;
+		return slab_allocate(arena, slabClass(size));
+	}
+
+	size_t totalSize = getTotalSize(size);
+	arena->stats.allocs[getIndex(totalSize)]++;
+	return allocate(arena, totalSize);
+}
+
+
+// free a slab object or heap block owned by the arena.
+// The caller must hold the arena lock
+static void arena_free(struct arena* arena, void* bp)
+{
+	if( isRunPage(bp) )
+	{
+		arena->stats.slabFrees[getRun(bp)->sizeClass]++;
+		slab_free(arena, bp);
+		return;
+	}
+
+	arena->stats.frees[getIndex(getSize((char*)bp - 8))]++;
+	if( !quick_free(arena, bp) )
+		free_block(arena, bp);
+}
+
+/**********************************************************
+ * REMOTE FREES
+ * A thread that frees a block of an arena it does not
+ * allocate from, or whose lock is taken, pushes it onto the
+ * arena's remote list with a single compare-and-swap instead
+ * of waiting for the lock.  The block stays marked as
+ * allocated, like a cached one, and is linked through the
+ * first 8 bytes of its data, so a chain flushed from a
+ * thread cache goes on as it is.  The next thread to take
+ * the lock for an allocation, or mm_trim, frees the whole
+ * list
+ **********************************************************/
+
+
+// push the chain of blocks from first to last onto the
+// arena's remote list
+static void remote_push(struct arena* arena, char* first, char* last)
+{
+	char* head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+	do
+		*(char**)last = head;
+	while( !__atomic_compare_exchange_n(&arena->remote, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+}
+
+
+// free every block on the arena's remote list.  The list is
+// taken whole, so no block is ever popped while another
+// thread pushes, and there is no ABA problem.
+// The caller must hold the arena lock
+static void remote_drain(struct arena* arena)
+{
+	char* data = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+	while( data )
+	{
+		char* next = *(char**)data;
+		__builtin_prefetch(next, 1);
+		arena_free(arena, data);
+		arena->stats.remoteFrees++;
+		data = next;
+	}
+}
+
+
+// take the arena lock to allocate or trim, first freeing
+// the blocks other threads have left on the remote list
+static void lock_arena(struct arena* arena)
+{
+	pthread_mutex_lock(&arena->lock);
+	if( __atomic_load_n(&arena->remote, __ATOMIC_RELAXED) )
+		remote_drain(arena);
+}
+
+/**********************************************************
+ * DIRECT MAPPINGS
+ **********************************************************/
+
+
+// given a pointer to the data section of a block that is
+// not a slab object, return whether it has its own mapping
+static int isMapped(void* bp)
+{
+	return __atomic_load_n((uintptr_t*)((char*)bp - 8), __ATOMIC_RELAXED) & MMAPPED;
+}
+
+
+/**********************************************************
+ * mmap_allocate
+ * Give a large request a mapping of its own, with room for
+ * a header that keeps the data section 16 byte aligned
+ **********************************************************/
+static void* mmap_allocate(size_t size)
+{
+	size_t length = pageRoundUp(size + 16);
+
+	char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if( MAP_FAILED == base )
+		return NULL;
+
+	*(uintptr_t*)(base + 8) = (length - 8) | MMAPPED | PREV_ALLOCATED | 1;
+	__atomic_fetch_add(&mappedBytes, length, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mappedBlocks, 1, __ATOMIC_RELAXED);
+	return base + 16;
+}
+
+
+/**********************************************************
+ * mmap_free
+ * Unmap a block given its own mapping by mmap_allocate
+ **********************************************************/
+static void mmap_free(void* bp)
+{
+	char* base = (char*)bp - 16;
+	size_t length = getSize(base + 8) + 16;
+	munmap(base, length);
+	__atomic_fetch_sub(&mappedBytes, length, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&mappedBlocks, 1, __ATOMIC_RELAXED);
+}
+
+
+/**********************************************************
+ * mmap_resize
+ * Resize a block with its own mapping to hold size bytes
+ * of data, letting the kernel move its pages rather than
+ * copying them
+ *
+ * returns the new data pointer, or NULL if the mapping
+ * could not be resized, in which case it is unchanged
+ **********************************************************/
+static void* mmap_resize(void* bp, size_t size)
+{
+	char* base = (char*)bp - 16;
+	size_t oldLength = getSize(base + 8) + 16;
+	size_t length = pageRoundUp(size + 16);
+
+	if( length == oldLength )
+		return bp;
+
+	base = mremap(base, oldLength, length, MREMAP_MAYMOVE);
+	if( MAP_FAILED == base )
+		return NULL;
+
+	__atomic_fetch_add(&mappedBytes, length - oldLength, __ATOMIC_RELAXED);
+
+	*(uintptr_t*)(base + 8) = (length - 8) | MMAPPED | PREV_ALLOCATED | 1;
+	return base + 16;
+}
+
+
+/**********************************************************
+ * mm_set_mmap_threshold
+ * Set the smallest request that is given a mapping of its
+ * own instead of a block in an arena.  SIZE_MAX turns
+ * direct mappings off
+ **********************************************************/
+void mm_set_mmap_threshold(size_t bytes)
+{
+	mmapThreshold = bytes;
+}
+
+
+/**********************************************************
+ * mm_set_huge_pages
+ * Choose whether the next mm_init backs the heap with
+ * transparent huge pages.  The break is then aligned to and
+ * moved in whole huge pages, each new chunk is advised with
+ * MADV_HUGEPAGE, and trimming and purging give back only
+ * whole huge pages, so none is split into small ones
+ **********************************************************/
+void mm_set_huge_pages(int enable)
+{
+	hugePages = enable;
+}
+
+/**********************************************************
+ * TRIMMING AND DECAY
+ **********************************************************/
+
+_Static_assert(DECAY_MIN_SIZE >= TREE_MIN_SIZE, "blocks that decay must be tree nodes");
+
+
+// the first and last byte past the chunks purgeBlock gives
+// back from a free block at bp of size bytes: every whole
+// chunk after its tree node and before its footer, so a
+// huge page is never split
+static uintptr_t purgeStart(char* bp)
+{
+	return chunkRoundUp((uintptr_t)bp + sizeof(struct tree_node));
+}
+
+static uintptr_t purgeEnd(char* bp, size_t size)
+{
+	return ((uintptr_t)bp + size - 8) & ~(chunkBytes - 1);
+}
+
+
+// give the chunks inside the free block at bp back to the
+// system.  The caller must hold the arena lock
+static void purgeBlock(char* bp)
+{
+	uintptr_t start = purgeStart(bp);
+	uintptr_t end = purgeEnd(bp, getSize(bp));
+
+	if( end > start && 0 == madvise((void*)start, end - start, MADV_DONTNEED) )
+	{
+		__atomic_fetch_add(&purgeStats.purged, end - start, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&purgeStats.purges, 1, __ATOMIC_RELAXED);
+	}
+
+	setFreedTime(bp, 0);
+}
+
+
+/**********************************************************
+ * decay_arena
+ * Purge the pages inside the free blocks of at least
+ * DECAY_MIN_SIZE bytes that have sat on their lists for
+ * decayTime milliseconds, or inside all of them when all
+ * is set.  Without all, the lists are swept at most once
+ * every half of decayTime, and only while the arena is
+ * being used
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static void decay_arena(struct arena* arena, int all)
+{
+	uint64_t now = currentTime();
+
+	if( !all && (decayTime < 0 || now - arena->lastDecay < (uint64_t)decayTime / 2) )
+		return;
+
+	arena->lastDecay = now;
+
+	// DECAY_MIN_SIZE is a power of two, so it starts a list,
+	// and every list from there on is a tree
+	unsigned int index = findBin(arena, getIndex(DECAY_MIN_SIZE));
+	for(; index < LIST_COUNT; index = findBin(arena, index + 1))
+	{
+		struct tree_node* node = treeFirst((struct tree_node*)arena->array[index]);
+		for(; node; node = treeNext(node))
+		{
+			uint64_t freed = getFreedTime((char*)node);
+			if( freed && (all || now - freed >= (uint64_t)decayTime) )
+				purgeBlock((char*)node);
+		}
+	}
+}
+
+
+/**********************************************************
+ * trim_arena
+ * Move the break down when the newest segment of the arena
+ * ends at the break with a free block, giving back every
+ * whole chunk of that block while leaving a free block of
+ * at least MIN_BLOCK_SIZE bytes before the epilogue
+ *
+ * returns the number of bytes given back
+ *
+ * The caller must hold the arena lock
+ **********************************************************/
+static size_t trim_arena(struct arena* arena)
+{
+	struct segment* seg = arena->segments;
+	size_t released = 0;
+
+	if( !seg )
+		return 0;
+
+	pthread_mutex_lock(&sbrkLock);
+
+	char* segEnd = (char*)seg + seg->size;
+	char* epilogue = segEnd - 8;
+	if( segEnd == (char*)mem_heap_hi() + 1 && FREE == getPrevAlloc(epilogue) )
+	{
+		size_t blockSize = getSize(epilogue - 8);
+		char* bp = epilogue - blockSize;
+		size_t release = (blockSize - MIN_BLOCK_SIZE) & ~(chunkBytes - 1);
+
+		if( release )
+		{
+			// the block's list is found from its size, so
+			// unlink it before the size changes
+			removeFromList(arena, bp);
+
+			sbrkCalls++;
+			if( (void*)-1 != mem_sbrk(-(intptr_t)release) )
+			{
+				setSegment(segEnd - release, release, NULL);
+				seg->size -= release;
+				blockSize -= release;
+				*(uintptr_t*)(bp + blockSize) = 0 | 1;
+
+				__atomic_fetch_add(&purgeStats.trimmed, release, __ATOMIC_RELAXED);
+				released = release;
+			}
+
+			setSizeAlloc(bp, blockSize, FREE);
+			addToList(arena, bp);
+		}
+	}
+
+	pthread_mutex_unlock(&sbrkLock);
+	return released;
+}
+
+
+/**********************************************************
+ * mm_trim
+ * Return the calling thread's cached blocks to the heap,
+ * free the blocks on the remote lists, consolidate the
+ * quick-lists, move the break down past any free block at
+ * the top of the heap, and purge the pages inside every
+ * large free block regardless of how long it has been free
+ *
+ * returns the number of bytes given back to the system
+ **********************************************************/
+size_t mm_trim(void)
+{
+	size_t before = __atomic_load_n(&purgeStats.purged, __ATOMIC_RELAXED);
+	size_t released = 0;
+
+	mm_tcache_flush();
+
+	unsigned int a = 0;
+	for(; a < numArenas; a++)
+	{
+		struct arena* arena = &arenas[a];
+		lock_arena(arena);
+		consolidate(arena);
+		released += trim_arena(arena);
+		decay_arena(arena, 1);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	// purges by other threads in the meantime are counted too
+	return released + (__atomic_load_n(&purgeStats.purged, __ATOMIC_RELAXED) - before);
+}
+
+
+/**********************************************************
+ * mm_set_decay_time
+ * Set how many milliseconds a large free block sits unused
+ * before the pages inside it are given back to the system.
+ * 0 purges blocks as soon as they are freed, and a negative
+ * time turns purging off, leaving only mm_trim
+ **********************************************************/
+void mm_set_decay_time(long milliseconds)
+{
+	decayTime = milliseconds;
+}
+
+
+/**********************************************************
+ * mm_get_purge_stats
+ * Report how much memory has been given back to the system
+ * since the last mm_init
+ **********************************************************/
+void mm_get_purge_stats(struct mm_purge_stats* stats)
+{
+	stats->purged = __atomic_load_n(&purgeStats.purged, __ATOMIC_RELAXED);
+	stats->purges = __atomic_load_n(&purgeStats.purges, __ATOMIC_RELAXED);
+	stats->trimmed = __atomic_load_n(&purgeStats.trimmed, __ATOMIC_RELAXED);
+}
+
+/**********************************************************
+ * THREAD CACHE
+ **********************************************************/
+
+
+// given a heap block size, return the thread cache class
+// holding blocks of that size, or TCACHE_CLASSES if blocks
+// of that size are not cached
+static unsigned int tcacheBlockIndex(size_t blockSize)
+{
+	if( blockSize <= SLAB_MAX_SIZE || blockSize > TCACHE_MAX_SIZE )
+		return TCACHE_CLASSES;
+
+	return SLAB_CLASSES + (blockSize - SLAB_MAX_SIZE) / 16 - 1;
+}
+
+
+// given a request size, return the thread cache class
+// serving it, or TCACHE_CLASSES if it is not cached
+static unsigned int tcacheIndex(size_t size)
+{
+	if( size <= SLAB_MAX_SIZE )
+		return slabClass(size);
+
+	if( size > TCACHE_MAX_SIZE )
+		return TCACHE_CLASSES;
+
+	return tcacheBlockIndex(getTotalSize(size));
+}
+
+
+// given the data pointer of a cached block, return
+// the data pointer of the block below it on its stack
+static char* tcacheGetNext(char* data)
+{
+	return *(char**)data;
+}
+
+
+// given the data pointer of a cached block, set
+// the data pointer of the block below it on its stack
+static void tcacheSetNext(char* data, char* next)
+{
+	*(char**)data = next;
+}
+
+
+// return the arena the calling thread should allocate from,
+// either the one it was given round-robin on first use, or
+// the one belonging to the CPU it is currently running on
+static struct arena* get_arena(struct tcache* tc)
+{
+	if( MM_ARENA_PER_CPU == arenaPolicy )
+	{
+		int cpu = sched_getcpu();
+		return &arenas[(cpu < 0 ? 0 : (unsigned int)cpu) % numArenas];
+	}
+
+	return tc->arena;
+}
+
+
+// return blocks in the given class of the calling thread's
+// cache to the free lists of their arenas until only keep
+// are left, taking each arena lock once per run of blocks
+// that belong to it.  A run of blocks of another arena, or
+// of our own while its lock is taken, goes on the arena's
+// remote list instead
+static void tcache_flush_class(struct tcache* tc, unsigned int index, unsigned int keep)
+{
+	struct arena* own = get_arena(tc);
+	struct arena* locked = NULL;
+	struct arena* pushing = NULL;				// arena of the chain from first to last
+	char* first = NULL;
+	char* last = NULL;
+
+	while( tc->count[index] > keep )
+	{
+		char* data = tc->head[index];
+		tc->head[index] = tcacheGetNext(data);
+		tc->count[index]--;
+
+		struct arena* arena = getArena(data);
+		if( arena == locked )
+		{
+			arena_free(arena, data);
+			continue;
+		}
+		if( arena == pushing )
+		{
+			tcacheSetNext(last, data);
+			last = data;
+			continue;
+		}
+
+		if( locked )
+			pthread_mutex_unlock(&locked->lock);
+		locked = NULL;
+		if( pushing )
+			remote_push(pushing, first, last);
+		pushing = NULL;
+
+		// blocks of other arenas, and of our own while
+		// another thread holds its lock, are pushed
+		if( arena == own && 0 == pthread_mutex_trylock(&arena->lock) )
+		{
+			locked = arena;
+			arena_free(arena, data);
+		}
+		else
+		{
+			pushing = arena;
+			first = last = data;
+		}
+	}
+
+	if( locked )
+		pthread_mutex_unlock(&locked->lock);
+	if( pushing )
+		remote_push(pushing, first, last);
+}
+
+
+// thread exit destructor, flush the whole cache
+static void tcache_destroy(void* arg)
+{
+	struct tcache* tc = arg;
+	if( tc->generation != heapGeneration )
+		return;
+
+	unsigned int i = 0;
+	for(; i < TCACHE_CLASSES; i++)
+	{
+		tcache_flush_class(tc, i, 0);
+	}
+}
+
+
+static void tcache_make_key(void)
+{
+	pthread_key_create(&tcacheKey, tcache_destroy);
+}
+
+
+// return the calling thread's cache, registering the exit
+// destructor on first use and discarding any blocks that
+// belong to a heap from before the last mm_init
+static struct tcache* get_tcache(void)
+{
+	struct tcache* tc = &threadCache;
+
+	if( !threadCacheRegistered )
+	{
+		// pthread_setspecific may call malloc, which must
+		// not come back here
+		threadCacheRegistered = 1;
+		pthread_once(&tcacheKeyOnce, tcache_make_key);
+		pthread_setspecific(tcacheKey, tc);
+	}
+
+	if( tc->generation != heapGeneration )
+	{
+		memset(tc->count, 0, sizeof(tc->count));
+		memset(tc->head, 0, sizeof(tc->head));
+		tc->arena = &arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % numArenas];
+		tc->generation = heapGeneration;
+	}
+
+	return tc;
+}
+
+
+/**********************************************************
+ * tcache_refill
+ * Fill an empty class of the thread cache with half its
+ * capacity worth of blocks, allocated from the free lists
+ * of the thread's arena under a single acquisition of its lock
+ *
+ * Returns one more block of the same size for the caller,
+ * or NULL if the heap could not be extended
+ **********************************************************/
+static void* tcache_refill(struct tcache* tc, unsigned int index, size_t size)
+{
+	unsigned int batch = tcacheCapacity[index] / 2;
+	struct arena* arena = get_arena(tc);
+
+	lock_arena(arena);
+	char* data = arena_malloc(arena, size);
+	while( data && tc->count[index] < batch )
+	{
+		char* extra = arena_malloc(arena, size);
+		if( !extra )
+			break;
+
+		tcacheSetNext(extra, tc->head[index]);
+		tc->head[index] = extra;
+		tc->count[index]++;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return data;
+}
+
+
+/**********************************************************
+ * mm_tcache_set_capacity
+ * Set how many blocks of the given request size each
+ * thread may cache.  A size of 0 applies the capacity
+ * to every class, and a capacity of 0 disables caching
+ **********************************************************/
+void mm_tcache_set_capacity(size_t size, unsigned int capacity)
+{
+	if( 0 == size )
+	{
+		unsigned int i = 0;
+		for(; i < TCACHE_CLASSES; i++)
+			tcacheCapacity[i] = capacity;
+		return;
+	}
+
+	unsigned int index = tcacheIndex(size);
+	if( index < TCACHE_CLASSES )
+		tcacheCapacity[index] = capacity;
+}
+
+
+/**********************************************************
+ * mm_tcache_flush
+ * Return every block cached by the calling thread
+ * to the free lists
+ **********************************************************/
+void mm_tcache_flush(void)
+{
+	tcache_destroy(get_tcache());
+}
+
+
+/**********************************************************
+ * tcache_malloc
+ * Small requests are served from the calling thread's cache,
+ * refilling it from the thread's arena when it runs dry.
+ * Requests of at least mmapThreshold bytes get a mapping of
+ * their own.  Everything else goes straight to the arena,
+ * which uses a slab run for requests up to SLAB_MAX_SIZE
+ * bytes and a heap block otherwise
+ **********************************************************/
+static inline __attribute__((always_inline)) void* tcache_malloc(size_t size)
+{
+    /* Ignore spurious requests */
+    if ( 0 == size || size > MAX_REQUEST )
+        return NULL;
+
+    struct tcache* tc = get_tcache();
+    unsigned int index = tcacheIndex(size);
+
+    if( index < TCACHE_CLASSES )
+    {
+    	char* data = tc->head[index];
+
+    	if( data )
+    	{
+    		tc->head[index] = tcacheGetNext(data);
+    		tc->count[index]--;
+    		return data;
+    	}
+
+    	if( tcacheCapacity[index] > 1 )
+    		return tcache_refill(tc, index, size);
+    }
+
+    if( size >= mmapThreshold )
+    	return mmap_allocate(size);
+
+    struct arena* arena = get_arena(tc);
+    lock_arena(arena);
+    void* data = arena_malloc(arena, size);
+    pthread_mutex_unlock(&arena->lock);
+
+    return data;
+}
+
+
+/**********************************************************
+ * tcache_free
+ * Push a block or slab object of the given class onto the
+ * calling thread's cache, flushing half the class once it
+ * is over capacity.  Anything of no class, TCACHE_CLASSES,
+ * is freed directly to the arena that owns it
+ **********************************************************/
+static inline __attribute__((always_inline)) void tcache_free(void* bp, unsigned int index)
+{
+    if( index < TCACHE_CLASSES )
+    {
+    	struct tcache* tc = get_tcache();
+
+    	tcacheSetNext(bp, tc->head[index]);
+    	tc->head[index] = bp;
+    	tc->count[index]++;
+
+    	if( tc->count[index] > tcacheCapacity[index] )
+    		tcache_flush_class(tc, index, tcacheCapacity[index] / 2);
+    	return;
+    }
+
+    struct arena* arena = getArena(bp);
+    if( arena != get_arena(get_tcache()) || 0 != pthread_mutex_trylock(&arena->lock) )
+    {
+    	remote_push(arena, bp, bp);
+    	return;
+    }
+
+    arena_free(arena, bp);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+
+/**********************************************************
+ * SAMPLING PROFILER
+ **********************************************************/
+
+
+// return the next number from the calling thread's
+// xorshift64* generator
+static uint64_t sampleRandom(void)
+{
+	uint64_t x = sampleSeed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sampleSeed = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+// return the bytes to allocate before the next sample, drawn
+// from an exponential distribution with a mean of rate bytes,
+// so that every byte allocated is equally likely to be sampled
+static intptr_t nextSampleCountdown(size_t rate)
+{
+	// 53 random bits give a uniform number in (0, 1]
+	double u = ((sampleRandom() >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double bytes = -log(u) * rate;
+
+	if( bytes > INTPTR_MAX / 2 )
+		return INTPTR_MAX / 2;
+	return (intptr_t)bytes + 1;
+}
+
+
+// hash a data pointer into a table of 1 << bits buckets
+static unsigned int pointerHash(void* data, unsigned int bits)
+{
+	return (unsigned int)((((uintptr_t)data >> 4) * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+
+// return size bytes of zeroed memory for a profile record,
+// mapping another chunk once the newest one is used up, or
+// NULL if the mapping fails.  Profile records never come
+// from the heap being profiled
+//
+// The caller must hold profileLock
+static void* profileAlloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+
+	if( (size_t)(profileEnd - profileBump) < size )
+	{
+		char* chunk = mmap(NULL, PROFILE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if( MAP_FAILED == chunk )
+			return NULL;
+
+		*(char**)chunk = profileChunks;
+		profileChunks = chunk;
+		profileBump = chunk + 16;
+		profileEnd = chunk + PROFILE_CHUNK;
+	}
+
+	void* record = profileBump;
+	profileBump += size;
+	return record;
+}
+
+
+/**********************************************************
+ * profile_reset
+ * Forget every sample and call stack and unmap the memory
+ * holding them, since the blocks they describe are gone
+ * once mm_init starts a new heap
+ **********************************************************/
+static void profile_reset(void)
+{
+	pthread_mutex_lock(&profileLock);
+
+	while( profileChunks )
+	{
+		char* next = *(char**)profileChunks;
+		munmap(profileChunks, PROFILE_CHUNK);
+		profileChunks = next;
+	}
+	profileBump = profileEnd = NULL;
+
+	memset(sampleTable, 0, sizeof(sampleTable));
+	memset(stackTable, 0, sizeof(stackTable));
+	memset(sampleFilter, 0, sizeof(sampleFilter));
+	stackList = NULL;
+	freeSamples = NULL;
+	__atomic_store_n(&sampledBlocks, 0, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&profileLock);
+}
+
+
+// return the record for the call stack of depth frames at
+// pcs, adding one if it has not been seen before, or NULL
+// if there is no memory for a new record
+//
+// The caller must hold profileLock
+static struct stack* findStack(void** pcs, int depth)
+{
+	uint64_t hash = depth;
+	int i = 0;
+	for(; i < depth; i++)
+		hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001B3ULL;
+
+	struct stack** bucket = &stackTable[hash >> (64 - STACK_HASH_BITS)];
+	struct stack* stack = *bucket;
+	for(; stack; stack = stack->next)
+	{
+		if( stack->hash == hash && stack->depth == depth
+				&& 0 == memcmp(stack->pcs, pcs, depth * sizeof(void*)) )
+			return stack;
+	}
+
+	stack = profileAlloc(sizeof(struct stack));
+	if( !stack )
+		return NULL;
+
+	stack->hash = hash;
+	stack->depth = depth;
+	memcpy(stack->pcs, pcs, depth * sizeof(void*));
+	stack->next = *bucket;
+	*bucket = stack;
+	stack->all = stackList;
+	stackList = stack;
+	return stack;
+}
+
+
+/**********************************************************
+ * profile_record
+ * Record the block at data, of size bytes, as a sample of
+ * the call stack that allocated it.  caller is the return
+ * address into the code that called mm_malloc, and every
+ * frame above it belongs to the allocator and is left out
+ **********************************************************/
+static void profile_record(void* data, size_t size, void* caller)
+{
+	void* pcs[PROFILE_DEPTH + 8];
+
+	// backtrace may allocate the first time it runs
+	inProfiler = 1;
+	int depth = backtrace(pcs, PROFILE_DEPTH + 8);
+	inProfiler = 0;
+
+	int skip = 0;
+	while( skip < depth && pcs[skip] != caller )
+		skip++;
+	if( skip == depth )
+		skip = 0;
+
+	depth -= skip;
+	if( depth > PROFILE_DEPTH )
+		depth = PROFILE_DEPTH;
+
+	pthread_mutex_lock(&profileLock);
+
+	struct stack* stack = findStack(pcs + skip, depth);
+	struct sample* sample = freeSamples;
+	if( sample )
+		freeSamples = sample->next;
+	else
+		sample = profileAlloc(sizeof(struct sample));
+
+	if( stack && sample )
+	{
+		stack->allocs++;
+		stack->allocBytes += size;
+
+		unsigned int hash = pointerHash(data, SAMPLE_HASH_BITS);
+		sample->data = data;
+		sample->size = size;
+		sample->stack = stack;
+		sample->next = sampleTable[hash];
+		sampleTable[hash] = sample;
+
+		__atomic_fetch_add(&sampleFilter[pointerHash(data, SAMPLE_FILTER_BITS)], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sampledBlocks, 1, __ATOMIC_RELAXED);
+	}
+	else if( sample )
+	{
+		sample->next = freeSamples;
+		freeSamples = sample;
+	}
+
+	pthread_mutex_unlock(&profileLock);
+}
+
+
+/**********************************************************
+ * profile_free
+ * Stop tracking the block at data if it was sampled, adding
+ * it to the frees of the call stack that allocated it.
+ * Blocks whose filter counter is 0 were never sampled and
+ * are skipped without taking profileLock
+ **********************************************************/
+static void profile_free(void* data)
+{
+	uint16_t* filter = &sampleFilter[pointerHash(data, SAMPLE_FILTER_BITS)];
+	if( 0 == __atomic_load_n(filter, __ATOMIC_RELAXED) )
+		return;
+
+	pthread_mutex_lock(&profileLock);
+
+	struct sample** link = &sampleTable[pointerHash(data, SAMPLE_HASH_BITS)];
+	while( *link && (*link)->data != data )
+		link = &(*link)->next;
+
+	struct sample* sample = *link;
+	if( sample )
+	{
+		*link = sample->next;
+		sample->stack->frees++;
+		sample->stack->freeBytes += sample->size;
+		sample->next = freeSamples;
+		freeSamples = sample;
+
+		__atomic_fetch_sub(filter, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&sampledBlocks, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&profileLock);
+}
+
+
+// buffered output to a file descriptor using only calls
+// that are safe in a signal handler, and no allocation
+struct profile_writer
+{
+	int fd;
+	int failed;
+	size_t used;
+	char buf[4096];
+};
+
+
+static void writerFlush(struct profile_writer* w)
+{
+	size_t done = 0;
+	while( done < w->used && !w->failed )
+	{
+		ssize_t n = write(w->fd, w->buf + done, w->used - done);
+		if( n > 0 )
+			done += n;
+		else if( n < 0 && EINTR != errno )
+			w->failed = 1;
+	}
+	w->used = 0;
+}
+
+
+static void writerBytes(struct profile_writer* w, const char* bytes, size_t length)
+{
+	while( length )
+	{
+		if( w->used == sizeof(w->buf) )
+			writerFlush(w);
+
+		size_t n = sizeof(w->buf) - w->used;
+		if( n > length )
+			n = length;
+		memcpy(w->buf + w->used, bytes, n);
+		w->used += n;
+		bytes += n;
+		length -= n;
+	}
+}
+
+
+static void writerString(struct profile_writer* w, const char* string)
+{
+	writerBytes(w, string, strlen(string));
+}
+
+
+static void writerNumber(struct profile_writer* w, uint64_t value, unsigned int base)
+{
+	char digits[24];
+	int i = sizeof(digits);
+	do
+	{
+		digits[--i] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while( value );
+
+	writerBytes(w, digits + i, sizeof(digits) - i);
+}
+
+
+// write one "in use: bytes [allocated: bytes]" count pair
+static void writerCounts(struct profile_writer* w, uint64_t inUse, uint64_t inUseBytes,
+		uint64_t allocs, uint64_t allocBytes)
+{
+	writerNumber(w, inUse, 10);
+	writerString(w, ": ");
+	writerNumber(w, inUseBytes, 10);
+	writerString(w, " [");
+	writerNumber(w, allocs, 10);
+	writerString(w, ": ");
+	writerNumber(w, allocBytes, 10);
+	writerString(w, "] @");
+}
+
+
+/**********************************************************
+ * profile_write
+ * Write every call stack with samples to fd in the legacy
+ * heap profile format pprof reads, followed by the memory
+ * map of the process so pprof can symbolize the addresses.
+ * Counts are of samples, and pprof scales them back up
+ * using the rate in the header
+ *
+ * returns 0, or -1 if a write failed
+ *
+ * The caller must hold profileLock
+ **********************************************************/
+static int profile_write(int fd)
+{
+	struct profile_writer w;
+	w.fd = fd;
+	w.failed = 0;
+	w.used = 0;
+
+	uint64_t inUse = 0, inUseBytes = 0, allocs = 0, allocBytes = 0;
+	struct stack* stack = stackList;
+	for(; stack; stack = stack->all)
+	{
+		inUse += stack->allocs - stack->frees;
+		inUseBytes += stack->allocBytes - stack->freeBytes;
+		allocs += stack->allocs;
+		allocBytes += stack->allocBytes;
+	}
+
+	writerString(&w, "heap profile: ");
+	writerCounts(&w, inUse, inUseBytes, allocs, allocBytes);
+	writerString(&w, " heap_v2/");
+	writerNumber(&w, profileRate ? profileRate : 1, 10);
+	writerString(&w, "\n");
+
+	for(stack = stackList; stack; stack = stack->all)
+	{
+		writerCounts(&w, stack->allocs - stack->frees, stack->allocBytes - stack->freeBytes,
+				stack->allocs, stack->allocBytes);
+
+		int i = 0;
+		for(; i < stack->depth; i++)
+		{
+			writerString(&w, " 0x");
+			writerNumber(&w, (uintptr_t)stack->pcs[i], 16);
+		}
+		writerString(&w, "\n");
+	}
+
+	writerString(&w, "\nMAPPED_LIBRARIES:\n");
+	writerFlush(&w);
+
+	int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if( maps >= 0 )
+	{
+		ssize_t n;
+		while( (n = read(maps, w.buf, sizeof(w.buf))) > 0 || (n < 0 && EINTR == errno) )
+		{
+			if( n < 0 )
+				continue;
+			w.used = n;
+			writerFlush(&w);
+		}
+		close(maps);
+	}
+
+	return w.failed ? -1 : 0;
+}
+
+
+// write the next dump asked for by a signal to a file named
+// profilePrefix.NNNN.heap
+//
+// The caller must hold profileLock
+static void profile_dump_numbered(void)
+{
+	char path[sizeof(profilePrefix) + 32];
+	size_t length = strlen(profilePrefix);
+	memcpy(path, profilePrefix, length);
+
+	unsigned int number = profileDumps++;
+	path[length++] = '.';
+	int digit = 3;
+	for(; digit >= 0; digit--)
+	{
+		path[length + digit] = '0' + number % 10;
+		number /= 10;
+	}
+	memcpy(path + length + 4, ".heap", sizeof(".heap"));
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if( fd >= 0 )
+	{
+		profile_write(fd);
+		close(fd);
+	}
+}
+
+
+// signal handler installed by mm_profile_signal.  When the
+// interrupted code holds profileLock the dump is left to the
+// next sampled allocation
+static void profile_signal(int signo)
+{
+	(void)signo;
+	int savedErrno = errno;
+
+	if( 0 == pthread_mutex_trylock(&profileLock) )
+	{
+		profile_dump_numbered();
+		pthread_mutex_unlock(&profileLock);
+	}
+	else
+		profileDumpPending = 1;
+
+	errno = savedErrno;
+}
+
+
+/**********************************************************
+ * sample_malloc
+ * Allocate through tcache_malloc and count the bytes against
+ * the calling thread's countdown, recording the block as a
+ * sample when the countdown runs out.  caller is the return
+ * address of mm_malloc.  Allocations made while a sample is
+ * being recorded are never sampled themselves
+ **********************************************************/
+static __attribute__((noinline)) void* sample_malloc(size_t size, void* caller)
+{
+	void* data = tcache_malloc(size);
+	size_t rate = __atomic_load_n(&sampleRate, __ATOMIC_RELAXED);
+	if( !data || !rate || inProfiler )
+		return data;
+
+	if( 0 == sampleSeed )
+	{
+		sampleSeed = ((uintptr_t)&sampleSeed ^ (currentTime() * 0x9E3779B97F4A7C15ULL)) | 1;
+		sampleCountdown = nextSampleCountdown(rate);
+	}
+
+	sampleCountdown -= size;
+	if( sampleCountdown > 0 )
+		return data;
+
+	sampleCountdown = nextSampleCountdown(rate);
+	profile_record(data, size, caller);
+
+	if( profileDumpPending )
+	{
+		pthread_mutex_lock(&profileLock);
+		if( profileDumpPending )
+		{
+			profileDumpPending = 0;
+			profile_dump_numbered();
+		}
+		pthread_mutex_unlock(&profileLock);
+	}
+
+	return data;
+}
+
+
+/**********************************************************
+ * mm_set_sample_rate
+ * Sample about one allocation per bytes allocated, 0 turns
+ * sampling off.  Blocks sampled already are still tracked
+ * until they are freed
+ **********************************************************/
+void mm_set_sample_rate(size_t bytes)
+{
+	if( bytes )
+	{
+		// have backtrace load whatever it needs now,
+		// rather than in the middle of a sample
+		void* pc;
+		inProfiler = 1;
+		backtrace(&pc, 1);
+		inProfiler = 0;
+
+		pthread_mutex_lock(&profileLock);
+		profileRate = bytes;
+		pthread_mutex_unlock(&profileLock);
+	}
+
+	__atomic_store_n(&sampleRate, bytes, __ATOMIC_RELAXED);
+}
+
+
+/**********************************************************
+ * mm_profile_dump
+ * Write a heap profile of the sampled blocks to the file at
+ * path, for pprof
+ *
+ * returns 0, or -1 if the file could not be written
+ **********************************************************/
+int mm_profile_dump(const char* path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if( fd < 0 )
+		return -1;
+
+	pthread_mutex_lock(&profileLock);
+	int result = profile_write(fd);
+	pthread_mutex_unlock(&profileLock);
+
+	if( close(fd) )
+		result = -1;
+	return result;
+}
+
+
+/**********************************************************
+ * mm_profile_signal
+ * Write a heap profile named prefix.0000.heap, prefix.0001.heap
+ * and so on each time the process receives signal signo
+ *
+ * returns 0, or -1 if the prefix is too long or the handler
+ * could not be installed
+ **********************************************************/
+int mm_profile_signal(int signo, const char* prefix)
+{
+	if( strlen(prefix) >= sizeof(profilePrefix) )
+		return -1;
+
+	pthread_mutex_lock(&profileLock);
+	strcpy(profilePrefix, prefix);
+	pthread_mutex_unlock(&profileLock);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profile_signal;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	return sigaction(signo, &action, NULL);
+}
+
+/**********************************************************
+ * mm_free
+ * Find the thread cache class of the block or slab object
+ * and free it through tcache_free.  Mappings are unmapped
+ **********************************************************/
+void mm_free(void *bp)
+{
+    if(bp == NULL){
+      return;
+    }
+
+    if( __builtin_expect(0 != __atomic_load_n(&sampledBlocks, __ATOMIC_RELAXED), 0) )
+    	profile_free(bp);
+
+    unsigned int index;
+    if( isRunPage(bp) )
+    	index = getRun(bp)->sizeClass;
+    else if( isMapped(bp) )
+    {
+    	mmap_free(bp);
+    	return;
+    }
+    else
+    	index = tcacheBlockIndex(getAllocatedSize((char*)bp - 8));
+
+    tcache_free(bp, index);
+}
+
+
+/**********************************************************
+ * mm_free_sized
+ * Free a block given the size it was allocated, or last
+ * reallocated, with.  The page map alone tells a mapping,
+ * a slab object and a heap block apart, and the thread
+ * cache class comes from size, so neither the header nor
+ * the slab run is read on the way into the cache
+ *
+ * A block is never smaller than its size implies, so a
+ * block cached in a class below its own only hands out
+ * more room than asked for until it is freed again
+ **********************************************************/
+void mm_free_sized(void *bp, size_t size)
+{
+    if( !bp )
+    	return;
+
+    if( __builtin_expect(0 != __atomic_load_n(&sampledBlocks, __ATOMIC_RELAXED), 0) )
+    	profile_free(bp);
+
+    uintptr_t entry = *getPageEntry(bp);
+    unsigned int index;
+    if( 0 == entry )
+    {
+    	mmap_free(bp);
+    	return;
+    }
+    else if( entry & RUN_PAGE )
+    	index = (size && size <= SLAB_MAX_SIZE) ? slabClass(size) : getRun(bp)->sizeClass;
+    else if( size && size <= TCACHE_MAX_SIZE )
+    	index = tcacheBlockIndex(getTotalSize(size));
+    else
+    	index = tcacheBlockIndex(getAllocatedSize((char*)bp - 8));
+
+    tcache_free(bp, index);
+}
+
+
+/**********************************************************
+ * mm_free_class
+ * mm_free_sized with the thread cache class already worked
+ * out from the size by MM_SIZE_CLASS, usually at compile
+ * time.  The page map tells a mapping, a slab object and a
+ * heap block apart first, since a slab object has no header
+ * to read, and cls is only taken when it is a class of that
+ * kind
+ **********************************************************/
+void mm_free_class(void *bp, unsigned int cls)
+{
+    if( !bp )
+    	return;
+
+    if( __builtin_expect(0 != __atomic_load_n(&sampledBlocks, __ATOMIC_RELAXED), 0) )
+    	profile_free(bp);
+
+    uintptr_t entry = *getPageEntry(bp);
+    unsigned int index;
+    if( 0 == entry )
+    {
+    	mmap_free(bp);
+    	return;
+    }
+    else if( entry & RUN_PAGE )
+    	index = cls < SLAB_CLASSES ? cls : getRun(bp)->sizeClass;
+    else if( cls >= SLAB_CLASSES && cls < TCACHE_CLASSES )
+    	index = cls;
+    else
+    	index = tcacheBlockIndex(getAllocatedSize((char*)bp - 8));
+
+    tcache_free(bp, index);
+}
+
+
+/**********************************************************
+ * mm_malloc
+ * Allocate through tcache_malloc, taking the sampling path
+ * instead only while the profiler is on
+ **********************************************************/
+void *mm_malloc(size_t size)
+{
+    if( __builtin_expect(0 != __atomic_load_n(&sampleRate, __ATOMIC_RELAXED), 0) )
+    	return sample_malloc(size, __builtin_return_address(0));
+
+    return tcache_malloc(size);
+}
+
+
+/**********************************************************
+ * mm_malloc_class
+ * mm_malloc for a request whose thread cache class, cls, is
+ * MM_SIZE_CLASS(size).  A hit in the cache pops the block
+ * without looking at size at all
+ **********************************************************/
+void *mm_malloc_class(size_t size, unsigned int cls)
+{
+    if( __builtin_expect(0 != __atomic_load_n(&sampleRate, __ATOMIC_RELAXED), 0) )
+    	return sample_malloc(size, __builtin_return_address(0));
+
+    if( cls < TCACHE_CLASSES )
+    {
+    	struct tcache* tc = get_tcache();
+    	char* data = tc->head[cls];
+
+    	if( data )
+    	{
+    		tc->head[cls] = tcacheGetNext(data);
+    		tc->count[cls]--;
+    		return data;
+    	}
+    }
+
+    return tcache_malloc(size);
+}
+
+/**********************************************************
+ * mm_realloc
+ * Resize the block in place whenever its neighbours allow:
+ * a shrinking block gives back its tail, and a growing block
+ * takes in the free block after it or, at the top of the
+ * heap, moves the break.  A block with its own mapping is
+ * resized with mremap, and a slab object keeps its slot
+ * while the size still fits its class
+ *
+ * Otherwise a new block is allocated, the old data is
+ * copied over to it, and the old block is freed.  A block
+ * that grows this way is given a quarter more room than was
+ * asked for, so a run of small appends only moves it once
+ * in a while.  The old block is left alone if the new one
+ * cannot be allocated
+ *********************************************************/
+void *mm_realloc(void *ptr, size_t size)
+{
+	/* If size == 0 then this is just free, and we return NULL. */
+	if(size == 0){
+	  mm_free(ptr);
+	  return NULL;
+	}
+	/* If oldptr is NULL, then this is just malloc. */
+	if (ptr == NULL)
+	  return (mm_malloc(size));
+
+	if( size > MAX_REQUEST )
+		return NULL;
+
+	size_t oldDataSize;
+
+	if( isRunPage(ptr) )
+	{
+		oldDataSize = slabObjectSize(getRun(ptr)->sizeClass);
+		if( size <= oldDataSize )
+			return ptr;
+	}
+	else if( isMapped(ptr) )
+	{
+		void* resized = mmap_resize(ptr, size);
+		if( resized )
+			return resized;
+
+		oldDataSize = getSize((char*)ptr - 8);
+	}
+	else
+	{
+		struct arena* arena = getArena(ptr);
+		char* blockHeader = (char*)ptr - 8;
+
+		pthread_mutex_lock(&arena->lock);
+		oldDataSize = getSize(blockHeader) - 8;
+		int resized = resize_block(arena, blockHeader, getTotalSize(size));
+		pthread_mutex_unlock(&arena->lock);
+
+		if( 0 == resized )
+			return ptr;
+	}
+
+	size_t request = size;
+	if( size > oldDataSize && size + size / 4 < mmapThreshold )
+		request += size / 4;
+
+	char* newBlock = mm_malloc(request);
+	if( !newBlock )
+		return NULL;
+
+	memcpy(newBlock, ptr, oldDataSize < size ? oldDataSize : size);
+	mm_free(ptr);
+	return newBlock;
+}
+
+/**********************************************************
+ * mm_calloc
+ * Allocate nmemb * size bytes of zeros, or return NULL if
+ * the product overflows
+ *
+ * A new mapping is zero already.  A heap block is zeroed
+ * only where it is not known to be: the part of it past
+ * the arena's fresh memory (see markUsed) is untouched
+ * since mem_sbrk gave it out, and the pages a purge gave
+ * back inside the free block it came from read as zero.
+ * Small blocks are simply cleared
+ **********************************************************/
+void *mm_calloc(size_t nmemb, size_t size)
+{
+	size_t bytes;
+	if( __builtin_mul_overflow(nmemb, size, &bytes) || 0 == bytes || bytes > MAX_REQUEST )
+		return NULL;
+
+	if( __builtin_expect(0 != __atomic_load_n(&sampleRate, __ATOMIC_RELAXED), 0) || bytes <= TCACHE_MAX_SIZE )
+	{
+		void* data = sample_malloc(bytes, __builtin_return_address(0));
+		if( data )
+			memset(data, 0, bytes);
+		return data;
+	}
+
+	if( bytes >= mmapThreshold )
+		return mmap_allocate(bytes);
+
+	size_t totalSize = getTotalSize(bytes);
+	struct arena* arena = get_arena(get_tcache());
+
+	lock_arena(arena);
+	char* fresh = arena->fresh;
+	struct segment* newest = arena->segments;
+	arena->stats.allocs[getIndex(totalSize)]++;
+	char* data = allocate(arena, totalSize);
+	if( arena->segments != newest )
+		fresh = arena->freshStart;
+	pthread_mutex_unlock(&arena->lock);
+
+	if( !data )
+		return NULL;
+
+	// the block is ours now, so it can be read without the lock
+	char* bp = data - 8;
+	char* end = bp + getAllocatedSize(bp);
+	char* zeroStart = end;
+	char* zeroEnd = end;
+	if( end > fresh )
+	{
+		zeroStart = (bp > fresh ? bp : fresh) + sizeof(struct tree_node);
+		zeroEnd = end - 8;
+	}
+	else if( totalSize >= DECAY_MIN_SIZE && 0 == getFreedTime(bp) )
+	{
+		zeroStart = (char*)purgeStart(bp);
+		zeroEnd = (char*)purgeEnd(bp, end - bp);
+	}
+
+	char* dataEnd = data + bytes;
+	if( zeroStart >= zeroEnd || zeroStart >= dataEnd )
+	{
+		memset(data, 0, bytes);
+		return data;
+	}
+
+	memset(data, 0, zeroStart - data);
+	if( zeroEnd < dataEnd )
+		memset(zeroEnd, 0, dataEnd - zeroEnd);
+	return data;
+}
+
+
+/**********************************************************
+ * mm_memalign
+ * Allocate size bytes whose data starts on a multiple of
+ * alignment, a power of two.  Alignments of up to 16 are
+ * what mm_malloc gives anyway.  Larger ones always get a
+ * heap block, whose slack in front of the aligned data is
+ * split off as a free block rather than wasted, since the
+ * data of a mapping sits 16 bytes into its first page
+ *
+ * Returns NULL with errno set to EINVAL if alignment is
+ * not a power of two
+ **********************************************************/
+void *mm_memalign(size_t alignment, size_t size)
+{
+	if( 0 == alignment || (alignment & (alignment - 1)) )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if( alignment <= 16 )
+		return mm_malloc(size);
+
+	if( 0 == size || size > MAX_REQUEST || alignment > MAX_REQUEST )
+		return NULL;
+
+	size_t totalSize = getTotalSize(size);
+	struct arena* arena = get_arena(get_tcache());
+
+	lock_arena(arena);
+	arena->stats.allocs[getIndex(totalSize)]++;
+	void* data = allocate_aligned(arena, totalSize, alignment);
+	pthread_mutex_unlock(&arena->lock);
+
+	return data;
+}
+
+
+/**********************************************************
+ * mm_aligned_alloc
+ * C11 aligned_alloc, which is mm_memalign
+ **********************************************************/
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+	return mm_memalign(alignment, size);
+}
+
+
+/**********************************************************
+ * mm_posix_memalign
+ * POSIX posix_memalign: store a block of size bytes aligned
+ * to alignment, a power of two multiple of sizeof(void*),
+ * in *memptr.  Returns 0, EINVAL for a bad alignment, or
+ * ENOMEM, leaving *memptr alone on failure
+ **********************************************************/
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if( alignment < sizeof(void*) || (alignment & (alignment - 1)) )
+		return EINVAL;
+
+	void* data = NULL;
+	if( size )
+	{
+		data = mm_memalign(alignment, size);
+		if( !data )
+			return ENOMEM;
+	}
+
+	*memptr = data;
+	return 0;
+}
+
+/**********************************************************
+ * mm_usable_size
+ * Return how many bytes of data the block at bp can hold,
+ * which may be more than it was allocated with
+ **********************************************************/
+size_t mm_usable_size(void *bp)
+{
+	if( !bp )
+		return 0;
+
+	if( isRunPage(bp) )
+		return slabObjectSize(getRun(bp)->sizeClass);
+
+	// a mapping's data runs from 16 bytes past its start to
+	// its end, see mmap_allocate
+	if( isMapped(bp) )
+		return getSize((char*)bp - 8);
+
+	return getAllocatedSize((char*)bp - 8) - 8;
+}
+
+/**********************************************************
+ * BATCHES
+ **********************************************************/
+
+
+// sort n data pointers by address: a quicksort on the
+// median of three, recursing into the smaller side only,
+// that leaves short ranges to an insertion sort
+static void sortAddresses(void** ptrs, size_t n)
+{
+	while( n > 16 )
+	{
+		void** mid = ptrs + n / 2;
+		void** last = ptrs + n - 1;
+		void* t;
+		if( *mid < *ptrs ) { t = *mid; *mid = *ptrs; *ptrs = t; }
+		if( *last < *mid ) { t = *last; *last = *mid; *mid = t; }
+		if( *mid < *ptrs ) { t = *mid; *mid = *ptrs; *ptrs = t; }
+
+		void* pivot = *mid;
+		size_t i = 0;
+		size_t j = n - 1;
+		for(;;)
+		{
+			while( ptrs[i] < pivot )
+				i++;
+			while( pivot < ptrs[j] )
+				j--;
+			if( i >= j )
+				break;
+			t = ptrs[i]; ptrs[i] = ptrs[j]; ptrs[j] = t;
+			i++;
+			j--;
+		}
+
+		// ptrs[0..j] holds no pointer above ptrs[j+1..n-1]
+		if( j + 1 < n - j - 1 )
+		{
+			sortAddresses(ptrs, j + 1);
+			ptrs += j + 1;
+			n -= j + 1;
+		}
+		else
+		{
+			sortAddresses(ptrs + j + 1, n - j - 1);
+			n = j + 1;
+		}
+	}
+
+	size_t i = 1;
+	for(; i < n; i++)
+	{
+		void* p = ptrs[i];
+		size_t j = i;
+		for(; j > 0 && p < ptrs[j - 1]; j--)
+			ptrs[j] = ptrs[j - 1];
+		ptrs[j] = p;
+	}
+}
+
+
+// split the allocated block at bp, which holds at least count
+// blocks of totalSize bytes, into count allocated blocks one
+// after another, storing their data pointers in ptrs.  The
+// last block keeps any slack
+static void carve_blocks(char* bp, size_t totalSize, size_t count, void** ptrs)
+{
+	size_t blockSize = getSize(bp);
+	size_t i = 0;
+	for(; i + 1 < count; i++)
+	{
+		setSizeAlloc(bp, totalSize, ALLOCATED);
+		ptrs[i] = bp + 8;
+		bp += totalSize;
+		*(uintptr_t*)bp = PREV_ALLOCATED;
+		blockSize -= totalSize;
+	}
+
+	setSizeAlloc(bp, blockSize, ALLOCATED);
+	ptrs[i] = bp + 8;
+}
+
+
+/**********************************************************
+ * mm_malloc_batch
+ * Allocate n blocks of size bytes, storing their data
+ * pointers in ptrs
+ *
+ * Blocks already in the calling thread's cache are used
+ * first.  Slab objects then come from the thread's arena
+ * under a single acquisition of its lock, and heap blocks
+ * are carved side by side out of one block found or made
+ * by allocate() for up to BATCH_MAX_BYTES of them at a time,
+ * instead of one search, split and list insert each
+ *
+ * Returns the number of blocks allocated, which is less
+ * than n only when the heap cannot grow
+ **********************************************************/
+size_t mm_malloc_batch(size_t size, size_t n, void** ptrs)
+{
+	size_t done = 0;
+
+	if( 0 == size || size > MAX_REQUEST )
+		return 0;
+
+	if( __builtin_expect(0 != __atomic_load_n(&sampleRate, __ATOMIC_RELAXED), 0) || size >= mmapThreshold )
+	{
+		// every block must get its own chance to be sampled
+		void* caller = __builtin_return_address(0);
+		for(; done < n; done++)
+		{
+			ptrs[done] = size >= mmapThreshold ? mmap_allocate(size) : sample_malloc(size, caller);
+			if( !ptrs[done] )
+				break;
+		}
+		return done;
+	}
+
+	struct tcache* tc = get_tcache();
+	unsigned int index = tcacheIndex(size);
+	if( index < TCACHE_CLASSES )
+	{
+		while( done < n && tc->head[index] )
+		{
+			ptrs[done++] = tc->head[index];
+			tc->head[index] = tcacheGetNext(tc->head[index]);
+			tc->count[index]--;
+		}
+	}
+
+	struct arena* arena = get_arena(tc);
+	lock_arena(arena);
+
+	if( size <= SLAB_MAX_SIZE )
+	{
+		unsigned int sizeClass = slabClass(size);
+		for(; done < n; done++)
+		{
+			ptrs[done] = slab_allocate(arena, sizeClass);
+			if( !ptrs[done] )
+				break;
+			arena->stats.slabAllocs[sizeClass]++;
+		}
+	}
+	else
+	{
+		size_t totalSize = getTotalSize(size);
+		size_t most = BATCH_MAX_BYTES / totalSize;
+		if( 0 == most )
+			most = 1;
+
+		while( done < n )
+		{
+			size_t count = n - done < most ? n - done : most;
+			char* data = allocate(arena, count * totalSize);
+			if( !data )
+				break;
+
+			carve_blocks(data - 8, totalSize, count, ptrs + done);
+			arena->stats.allocs[getIndex(totalSize)] += count;
+			done += count;
+		}
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+	return done;
+}
+
+
+/**********************************************************
+ * mm_free_batch
+ * Free the n blocks in ptrs, skipping NULL entries.  The
+ * contents of ptrs are reordered along the way
+ *
+ * Blocks small enough for the calling thread's cache go
+ * there while it has room, as mm_free would put them.  The
+ * rest go straight to the arenas that own them, taking each
+ * arena lock once per run of blocks it owns.  Heap blocks
+ * are sorted by address first, and a run of them that sit
+ * side by side is joined into one block, so it is coalesced
+ * and put on a free list once instead of once per block
+ **********************************************************/
+void mm_free_batch(void** ptrs, size_t n)
+{
+	if( __builtin_expect(0 != __atomic_load_n(&sampledBlocks, __ATOMIC_RELAXED), 0) )
+	{
+		size_t i = 0;
+		for(; i < n; i++)
+			if( ptrs[i] )
+				profile_free(ptrs[i]);
+	}
+
+	// the thread cache takes what it has room for, slab objects
+	// and mappings are freed as they come, and heap blocks are
+	// moved down to the front of ptrs
+	struct tcache* tc = get_tcache();
+	struct arena* locked = NULL;
+	size_t left = 0;
+	size_t i = 0;
+	for(; i < n; i++)
+	{
+		char* data = ptrs[i];
+		if( !data )
+			continue;
+
+		int slab = isRunPage(data);
+		unsigned int index;
+		if( slab )
+			index = getRun(data)->sizeClass;
+		else if( isMapped(data) )
+		{
+			mmap_free(data);
+			continue;
+		}
+		else
+			index = tcacheBlockIndex(getAllocatedSize(data - 8));
+
+		if( index < TCACHE_CLASSES && tc->count[index] < tcacheCapacity[index] )
+		{
+			tcacheSetNext(data, tc->head[index]);
+			tc->head[index] = data;
+			tc->count[index]++;
+		}
+		else if( slab )
+		{
+			struct arena* arena = getArena(data);
+			if( arena != locked )
+			{
+				if( locked )
+					pthread_mutex_unlock(&locked->lock);
+				pthread_mutex_lock(&arena->lock);
+				locked = arena;
+			}
+			arena->stats.slabFrees[index]++;
+			slab_free(arena, data);
+		}
+		else
+			ptrs[left++] = data;
+	}
+
+	n = left;
+	sortAddresses(ptrs, n);
+
+	i = 0;
+	while( i < n )
+	{
+		char* data = ptrs[i++];
+		struct arena* arena = getArena(data);
+		if( arena != locked )
+		{
+			if( locked )
+				pthread_mutex_unlock(&locked->lock);
+			pthread_mutex_lock(&arena->lock);
+			locked = arena;
+		}
+
+		// take in the blocks that follow this one directly
+		char* bp = data - 8;
+		size_t blockSize = getSize(bp);
+		arena->stats.frees[getIndex(blockSize)]++;
+		while( i < n && (char*)ptrs[i] == bp + blockSize + 8 )
+		{
+			size_t nextSize = getSize(bp + blockSize);
+			arena->stats.frees[getIndex(nextSize)]++;
+			blockSize += nextSize;
+			i++;
+		}
+
+		setSizeAlloc(bp, blockSize, ALLOCATED);
+		free_block(arena, data);
+	}
+
+	if( locked )
+		pthread_mutex_unlock(&locked->lock);
+}
+
+/**********************************************************
+ * PRIVATE HEAPS
+ **********************************************************/
+
+
+// unmap every segment of the heap but keep, which is left
+// as its only segment, and clear the page map entries of
+// the segments a general heap registered there
+static void unmap_segments(struct mm_heap* heap, struct segment* keep)
+{
+	struct segment* seg = heap->arena.segments;
+	while( seg )
+	{
+		struct segment* next = seg->next;
+		if( seg != keep )
+		{
+			if( MM_HEAP_GENERAL == heap->mode )
+			{
+				pthread_mutex_lock(&sbrkLock);
+				setSegment((char*)seg, seg->size, NULL);
+				pthread_mutex_unlock(&sbrkLock);
+			}
+			munmap(seg, seg->size);
+		}
+		seg = next;
+	}
+
+	heap->arena.segments = keep;
+	if( keep )
+		keep->next = NULL;
+}
+
+
+// the first byte a bump heap hands out from a segment, where
+// the data of the first block of a general segment would be
+static char* bumpStart(struct segment* seg)
+{
+	return (char*)(seg + 1) + 8;
+}
+
+
+/**********************************************************
+ * bump_grow
+ * Map a new segment for a bump heap, at least twice the
+ * size of the last up to HEAP_SEGMENT_MAX, and carve size
+ * bytes from its start.  Whatever was left of the old
+ * segment is not used again until the heap is reset
+ **********************************************************/
+static void* bump_grow(struct mm_heap* heap, size_t size)
+{
+	struct segment* last = heap->arena.segments;
+	size_t segSize = pageRoundUp(sizeof(struct segment) + 8 + size);
+
+	size_t doubled = last ? 2 * last->size : SEGMENT_MIN_SIZE;
+	if( doubled > HEAP_SEGMENT_MAX )
+		doubled = HEAP_SEGMENT_MAX;
+	if( segSize < doubled )
+		segSize = doubled;
+
+	struct segment* seg = mmap(NULL, segSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if( MAP_FAILED == seg )
+		return NULL;
+
+	seg->arena = &heap->arena;
+	seg->next = last;
+	seg->size = segSize;
+	heap->arena.segments = seg;
+
+	char* data = bumpStart(seg);
+	heap->bump = data + size;
+	heap->bumpEnd = (char*)seg + segSize;
+	return data;
+}
+
+
 /**********************************************************
- * place
- * Given a block in a free list, we want to prepare this
- * block to be returned by mm_malloc
- *
- * Remove the block from its free list, set it to allocated,
- * clear the next/previous pointers, and return a pointer
- * to just the data portion (skip the header)
+ * mm_heap_create
+ * Create an empty private heap, with free lists and
+ * segments of its own.  A general heap frees and reuses
+ * blocks like the shared arenas and takes its own lock, a
+ * bump heap only hands out memory until it is reset and is
+ * not locked at all
  *
- * If their is enough unneeded space in the chosen block
- * to make a new block, split the two blocks, and "free"
- * the unused portion so that it is stored appropriately
+ * returns NULL for an unknown mode or if the heap cannot
+ * be mapped
  **********************************************************/
-char* place(char* bp, unsigned int totalSizeNeeded, unsigned int arrayIndex)
+struct mm_heap *mm_heap_create(int mode)
 {
-	// marks the current block as allocated
-	// returns a pointer to the data section of this block
+	if( MM_HEAP_GENERAL != mode && MM_HEAP_BUMP != mode )
+		return NULL;
 
-	unsigned int blockSize = getSize(bp);
+	struct mm_heap* heap = mmap(NULL, pageRoundUp(sizeof(struct mm_heap)), PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if( MAP_FAILED == heap )
+		return NULL;
 
-	// STEP 1: remove from list
-	removeFromList(bp);
+	pthread_mutex_init(&heap->arena.lock, NULL);
+	clear_arena(&heap->arena);
+	heap->arena.heap = heap;
+	heap->arena.index = MAX_ARENAS;
+	heap->mode = mode;
+	heap->bump = NULL;
+	heap->bumpEnd = NULL;
 
-	if( totalSizeNeeded + 32 <= blockSize )
-	{
-		// then we split it up and free
-		unsigned int extraSize = blockSize - totalSizeNeeded;
-		blockSize = totalSizeNeeded;
+	return heap;
+}
 
-		char* toFree = bp + blockSize;
-		setSizeAlloc(toFree, extraSize, ALLOCATED);
-		setSizeAlloc(bp, blockSize, ALLOCATED);
 
-		setNext(bp, NULL);
-		setPrev(bp, NULL);
-		setNext(toFree, NULL);
-		setPrev(toFree, NULL);
+/**********************************************************
+ * mm_heap_malloc
+ * Allocate size bytes from the heap.  A bump heap moves its
+ * pointer on by size rounded up to 16 bytes, mapping a new
+ * segment when the newest one is full, while a general heap
+ * takes a slab object or heap block from its own arena.
+ * Nothing goes through a thread cache or gets a mapping of
+ * its own, so a reset gets back every block
+ **********************************************************/
+void *mm_heap_malloc(struct mm_heap *heap, size_t size)
+{
+	if( 0 == size || size > MAX_REQUEST )
+		return NULL;
 
-		// free the portion of the block that
-		// isn't needed
-		mm_free(toFree + 8);
-	}
-	else
+	if( MM_HEAP_BUMP == heap->mode )
 	{
-		// STEP 2: clear pointer fields in block, set to allocated
-		setSizeAlloc(bp, blockSize, ALLOCATED);
-		setNext(bp, NULL);
-		setPrev(bp, NULL);
+		size = (size + 15) & ~(size_t)15;
+
+		char* data = heap->bump;
+		if( size > (size_t)(heap->bumpEnd - data) )
+			return bump_grow(heap, size);
+
+		heap->bump = data + size;
+		return data;
 	}
 
-	// STEP 3: return pointer to data segment only
-	return bp + 8;
+	pthread_mutex_lock(&heap->arena.lock);
+	void* data = arena_malloc(&heap->arena, size);
+	pthread_mutex_unlock(&heap->arena.lock);
+
+	return data;
 }
 
+
 /**********************************************************
- * mm_free
- * Coalesce the block with its neighbouring blocks, and
- * insert it at the beginning of appropriate free list
+ * mm_heap_free
+ * Free a block of a general heap back to its arena.  Blocks
+ * of a bump heap are only given back by a reset
  **********************************************************/
-void mm_free(void *bp)
+void mm_heap_free(struct mm_heap *heap, void *bp)
 {
-    if(bp == NULL){
-      return;
-    }
+	if( !bp || MM_HEAP_BUMP == heap->mode )
+		return;
 
-    char* blockPointer = (char*)bp - 8;
+	pthread_mutex_lock(&heap->arena.lock);
+	arena_free(&heap->arena, bp);
+	pthread_mutex_unlock(&heap->arena.lock);
+}
 
-    // call coalesce, block pointer may now point to header of bigger block
-    blockPointer = coalesce(blockPointer);
 
-    unsigned int blockSize = getSize(blockPointer);
+/**********************************************************
+ * mm_heap_reset
+ * Free every block of the heap at once, without looking at
+ * any of them.  Only the newest segment, which is also the
+ * largest, is kept: a bump heap moves its pointer back to
+ * the start of it, and a general heap empties its lists and
+ * makes the segment one free block.  A heap that never
+ * outgrows its newest segment is reset in O(1), with no
+ * system calls
+ *
+ * No other thread may use the heap during the reset
+ **********************************************************/
+void mm_heap_reset(struct mm_heap *heap)
+{
+	struct segment* keep = heap->arena.segments;
+	unmap_segments(heap, keep);
+
+	if( MM_HEAP_BUMP == heap->mode )
+	{
+		if( keep )
+		{
+			heap->bump = bumpStart(keep);
+			heap->bumpEnd = (char*)keep + keep->size;
+		}
+		return;
+	}
+
+	// the counters show whether any slab run was started
+	struct arena* arena = &heap->arena;
+	unsigned int c = 0;
+	while( c < SLAB_CLASSES && 0 == arena->stats.slabAllocs[c] )
+		c++;
 
-    unsigned int arrayIndex = getIndex(blockSize);
-    char* oldHead = array[arrayIndex];
+	clear_arena(arena);
+	if( !keep )
+		return;
 
-    setPrev(blockPointer, NULL);
-    array[arrayIndex] = blockPointer;
+	arena->segments = keep;
+	arena->fresh = (char*)keep + keep->size;
 
-    setNext(blockPointer, oldHead);
-    if(oldHead)
-    	setPrev(oldHead, blockPointer);
+	// pages of the old runs lose their flag
+	if( c < SLAB_CLASSES )
+	{
+		pthread_mutex_lock(&sbrkLock);
+		setSegment((char*)keep, keep->size, keep);
+		pthread_mutex_unlock(&sbrkLock);
+	}
 
-    setSizeAlloc(blockPointer, blockSize, FREE);
+	char* bp = (char*)(keep + 1);
+	*(uintptr_t*)bp = PREV_ALLOCATED;
+	setSizeAlloc(bp, keep->size - SEGMENT_OVERHEAD, FREE);
+	*(uintptr_t*)((char*)keep + keep->size - 8) = 0 | 1;
+	addToList(arena, bp);
 }
 
 
 /**********************************************************
- * mm_malloc
- * Translate the request size to a block size, and determine
- * which free list this corresponds to
- *
- * Search the free list for the first block that fits,
- * moving to the next higher list if no blocks are found
- *
- * If a fit is found, the block is prepared by place()
- *
- * If no fit is found in any of the lists, the heap is
- * extended to meet the request
+ * mm_heap_destroy
+ * Unmap every segment of the heap and the heap itself.  No
+ * block of the heap may be used afterwards
  **********************************************************/
-void *mm_malloc(size_t size)
+void mm_heap_destroy(struct mm_heap *heap)
 {
-    /* Ignore spurious requests */
-    if ( 0 == size )
-        return NULL;
+	unmap_segments(heap, NULL);
+	pthread_mutex_destroy(&heap->arena.lock);
+	munmap(heap, pageRoundUp(sizeof(struct mm_heap)));
+}
 
-    unsigned int roundedSize = roundUp(size); 		// round to nearest 16
-    unsigned int totalSize = roundedSize + 16; 		// how much we need in total
-    unsigned int arrayIndex = getIndex(totalSize);  // find appropriate list index for size
+/**********************************************************
+ * FORK HANDLERS
+ * Meant for pthread_atfork, so that a child forked while
+ * another thread is inside the allocator does not inherit a
+ * lock that will never be released.  The prepare handler
+ * takes every lock in the order the allocator nests them
+ **********************************************************/
+void mm_fork_prepare(void)
+{
+	pthread_mutex_lock(&profileLock);
 
-    for(; arrayIndex < arrayLength; arrayIndex++)
-    {
-        if( NULL == array[arrayIndex] )
-        {
-        	continue;
-        }
-
-        // guaranteed that free list has entries in it
-        // but maybe they don't fit?
-        // Search the free list for a fit
-        char* bp = find_fit(totalSize, arrayIndex);
-        if ( bp )
-        {
-        	return place(bp, totalSize, arrayIndex);
-        }
+	unsigned int a = 0;
+	for(; a < MAX_ARENAS; a++)
+		pthread_mutex_lock(&arenas[a].lock);
 
-    }
+	pthread_mutex_lock(&sbrkLock);
+}
 
-    // either all lists are empty, or we couldn't find
-    // any blocks that fit, either way,
-    // just force allocate for this request
 
-    // STEP 0: Find original array index
-    arrayIndex = getIndex(totalSize);
+void mm_fork_parent(void)
+{
+	pthread_mutex_unlock(&sbrkLock);
 
-    // STEP 1: Save original list for original index
-    void* oldBeginning = array[arrayIndex];
+	unsigned int a = MAX_ARENAS;
+	while( a-- > 0 )
+		pthread_mutex_unlock(&arenas[a].lock);
 
-    // STEP 2: Call extend heap
-    void* newEnd = extend_heap(arrayIndex);
-    if( !newEnd )
-    	return NULL;
+	pthread_mutex_unlock(&profileLock);
+}
 
-    // STEP 3: Append old list to new list
-    // 		   new->next = old
-    //		   old->prev = new
-    setNext(newEnd, oldBeginning);
-    if( oldBeginning )
-    	setPrev(oldBeginning, newEnd);
 
-    // STEP 4: find_fit and place
-    char* bp = find_fit(totalSize, arrayIndex);
-    if ( bp )
-    {
-        return place(bp, totalSize, arrayIndex);
-    }
-    else
-    {
-    	assert(0);
-    	return NULL;
-    }
+// the child is left with only the thread that forked, so
+// the locks are made new rather than unlocked.  Blocks in
+// the caches of the other threads are never seen again
+void mm_fork_child(void)
+{
+	pthread_mutex_init(&sbrkLock, NULL);
 
+	unsigned int a = 0;
+	for(; a < MAX_ARENAS; a++)
+		pthread_mutex_init(&arenas[a].lock, NULL);
+
+	pthread_mutex_init(&profileLock, NULL);
 }
 
 /**********************************************************
- * mm_realloc
- * If the new data size is smaller than the old data size,
- * the pointer is immediately returned, as the block size
- * doesn't change, but we not have some unused bytes
- *
- * If the new data size is larger, we try to join this
- * allocated block with any neighbouring free blocks.  If
- * this new coalesced block is large enough, we shift the
- * data to be at the start of the new block, and return
- *
- * If this new coalesced block still can't meet the request,
- * we just free this block, and allocated a new block that
- * is large enough, and copy over the old data to the new block.
- *********************************************************/
-void *mm_realloc(void *ptr, size_t size)
+ * STATISTICS
+ **********************************************************/
+
+_Static_assert(MM_STATS_BINS == LIST_COUNT, "MM_STATS_BINS must match LIST_COUNT");
+_Static_assert(MM_SLAB_CLASSES == SLAB_CLASSES, "MM_SLAB_CLASSES must match SLAB_CLASSES");
+_Static_assert(MM_SIZE_CLASSES == TCACHE_CLASSES, "MM_SIZE_CLASSES must match TCACHE_CLASSES");
+_Static_assert(MM_SIZE_CLASS(SLAB_MAX_SIZE) == SLAB_CLASSES - 1, "MM_SIZE_CLASS must end the slab classes at SLAB_MAX_SIZE");
+_Static_assert(MM_SIZE_CLASS(TCACHE_MAX_SIZE - 8) == TCACHE_CLASSES - 1, "MM_SIZE_CLASS must end the cache classes at TCACHE_MAX_SIZE");
+_Static_assert(MM_SIZE_CLASS(TCACHE_MAX_SIZE - 7) == TCACHE_CLASSES, "MM_SIZE_CLASS must not cache blocks above TCACHE_MAX_SIZE");
+
+
+// return the smallest block size kept on the list at index,
+// the inverse of getIndex
+static size_t binMinSize(unsigned int index)
 {
-	/* If size == 0 then this is just free, and we return NULL. */
-	if(size == 0){
-	  mm_free(ptr);
-	  return NULL;
-	}
-	/* If oldptr is NULL, then this is just malloc. */
-	if (ptr == NULL)
-	  return (mm_malloc(size));
+	if( index < (2u << SL_BITS) )
+		return (size_t)index << 4;
+
+	unsigned int shift = (index >> SL_BITS) - 1;
+	size_t units = (index & ((1u << SL_BITS) - 1)) + (1u << SL_BITS);
+	return (units << shift) << 4;
+}
 
-	char* blockHeader = (char*)ptr - 8;
-	unsigned int blockSize = getSize(blockHeader);
-	unsigned int oldDataSize = blockSize - 16;
 
-	unsigned int newDataSize = (unsigned int)size;
+/**********************************************************
+ * mm_huge_bytes
+ * Add up the AnonHugePages lines of the mappings in
+ * /proc/self/smaps that overlap the heap.  The file is read
+ * through a buffer on the stack rather than stdio, so no
+ * allocation is made while mm is the process allocator.
+ * This reads and parses the whole file, so it is kept out
+ * of mm_stats, which only copies counters
+ *
+ * returns 0 if the file cannot be read
+ **********************************************************/
+size_t mm_huge_bytes(void)
+{
+	uintptr_t lo = (uintptr_t)mem_heap_lo();
+	uintptr_t hi = (uintptr_t)mem_heap_hi() + 1;
+	size_t total = 0;
+	int inHeap = 0;
 
-	if( newDataSize == oldDataSize )
-		return ptr;
+	int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+	if( fd < 0 )
+		return 0;
 
-	else if( newDataSize < oldDataSize )
+	char buf[4096];
+	size_t have = 0;
+	ssize_t got;
+	while( (got = read(fd, buf + have, sizeof(buf) - 1 - have)) > 0 )
 	{
-		if( (oldDataSize - newDataSize) >= 32 )
-		{
-			// can split off the new unused bytes
-			// and make a new block, but not worthwhile
-			// performance-wise
-			return ptr;
-		}
-		else
+		have += got;
+		buf[have] = '\0';
+
+		char* line = buf;
+		char* eol;
+		while( (eol = strchr(line, '\n')) )
 		{
-			// not releasing enough bytes to make a new block
-			return ptr;
+			*eol = '\0';
+
+			// a mapping starts with its address range, a hex
+			// word directly followed by '-'
+			unsigned long start, end;
+			if( 2 == sscanf(line, "%lx-%lx ", &start, &end) )
+				inHeap = start < hi && end > lo;
+			else if( inHeap && 0 == strncmp(line, "AnonHugePages:", 14) )
+				total += strtoull(line + 14, NULL, 10) * 1024;
+
+			line = eol + 1;
 		}
+
+		// keep the partial last line, or drop a line too long to matter
+		have = buf + have - line;
+		memmove(buf, line, have);
+		if( have == sizeof(buf) - 1 )
+			have = 0;
 	}
-	else //( newDataSize > oldDataSize )
+
+	close(fd);
+	return total;
+}
+
+
+/**********************************************************
+ * mm_stats
+ * Add up the counters of every arena.  Each arena lock is
+ * taken in turn, so the totals are not one snapshot of the
+ * whole heap, and requests served from a thread cache
+ * never reach an arena and are not counted by it
+ **********************************************************/
+void mm_stats(struct mm_stats* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	unsigned int i;
+	for(i = 0; i < LIST_COUNT; i++)
+		stats->bins[i].min_size = binMinSize(i);
+
+	unsigned int a = 0;
+	for(; a < numArenas; a++)
 	{
-		char* biggestBlock = coalesce(blockHeader);
-		unsigned int newSize = getSize(biggestBlock);
-		setSizeAlloc(biggestBlock, newSize, ALLOCATED);
+		struct arena* arena = &arenas[a];
+		struct arena_stats* as = &arena->stats;
+		pthread_mutex_lock(&arena->lock);
 
-		if( newSize - 16 >= newDataSize )
+		for(i = 0; i < LIST_COUNT; i++)
+		{
+			stats->bins[i].allocs += as->allocs[i];
+			stats->bins[i].frees += as->frees[i];
+			stats->bins[i].free_blocks += as->freeBlocks[i];
+			stats->bins[i].free_bytes += as->freeBytes[i];
+			stats->free_bytes += as->freeBytes[i];
+		}
+		for(i = 0; i < SLAB_CLASSES; i++)
 		{
-			// can split off the unused bytes
-			// and make a new block
-			memmove(biggestBlock + 8, ptr, oldDataSize);
+			stats->slab_allocs[i] += as->slabAllocs[i];
+			stats->slab_frees[i] += as->slabFrees[i];
+		}
+		for(i = 0; i < PROBE_BUCKETS; i++)
+			stats->probes[i] += as->probes[i];
+		for(i = 0; i < QUICK_CLASSES; i++)
+			stats->quick_bytes += (size_t)arena->quickCount[i] * (SLAB_MAX_SIZE + 16 * (i + 1));
 
-			return biggestBlock + 8;
+		stats->splits += as->splits;
+		stats->coalesces += as->coalesces;
+		stats->extends += as->extends;
+		stats->remote_frees += as->remoteFrees;
+
+		// the largest free block is on the highest non-empty list
+		unsigned int top = LIST_COUNT;
+		unsigned int index = findBin(arena, 0);
+		for(; index < LIST_COUNT; index = findBin(arena, index + 1))
+			top = index;
+		if( top >= TREE_MIN_INDEX && top < LIST_COUNT )
+		{
+			char* bp = (char*)treeLast((struct tree_node*)arena->array[top]);
+			if( getSize(bp) > stats->largest_free )
+				stats->largest_free = getSize(bp);
 		}
-		else
+		else if( top < LIST_COUNT )
 		{
-			// just malloc/free
-			char* newBlock = (char*)mm_malloc(newDataSize);
-			if( !newBlock )
-				return NULL;
+			char* bp = arena->array[top];
+			for(; bp; bp = getNext(bp))
+			{
+				if( getSize(bp) > stats->largest_free )
+					stats->largest_free = getSize(bp);
+			}
+		}
 
-			memcpy(newBlock, ptr, oldDataSize);
+		pthread_mutex_unlock(&arena->lock);
+	}
 
-			mm_free(biggestBlock + 8);
+	pthread_mutex_lock(&sbrkLock);
+	stats->heap_bytes = mem_heapsize();
+	stats->sbrk_calls = sbrkCalls;
+	pthread_mutex_unlock(&sbrkLock);
 
-			return newBlock;
-		}
+	stats->mapped_bytes = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+	stats->mapped_blocks = __atomic_load_n(&mappedBlocks, __ATOMIC_RELAXED);
+
+	size_t idle = stats->free_bytes + stats->quick_bytes;
+	stats->in_use_bytes = stats->heap_bytes + stats->mapped_bytes;
+	stats->in_use_bytes = (stats->in_use_bytes > idle) ? stats->in_use_bytes - idle : 0;
+}
+
+
+// print count unsigned counters as a JSON array
+static void printJsonArray(FILE* out, const uint64_t* counts, unsigned int count)
+{
+	unsigned int i = 0;
+	fputc('[', out);
+	for(; i < count; i++)
+		fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)counts[i]);
+	fputc(']', out);
+}
+
+
+/**********************************************************
+ * mm_stats_json
+ * Write the statistics from mm_stats to out as a single
+ * JSON object.  Free lists that have never been used are
+ * left out of "bins".  fragmentation is the share of free
+ * bytes outside the largest free block
+ *
+ * returns 0, or -1 if writing to out failed
+ **********************************************************/
+int mm_stats_json(FILE* out)
+{
+	struct mm_stats* stats = malloc(sizeof(*stats));
+	if( !stats )
+		return -1;
+
+	mm_stats(stats);
+
+	double fragmentation = 0;
+	if( stats->free_bytes )
+		fragmentation = 1.0 - (double)stats->largest_free / stats->free_bytes;
+
+	fprintf(out, "{\"heap_bytes\": %zu, \"mapped_bytes\": %zu, \"mapped_blocks\": %llu, "
+			"\"in_use_bytes\": %zu, \"free_bytes\": %zu, \"quick_bytes\": %zu, "
+			"\"largest_free\": %zu, \"fragmentation\": %.4f, ",
+			stats->heap_bytes, stats->mapped_bytes, (unsigned long long)stats->mapped_blocks,
+			stats->in_use_bytes, stats->free_bytes, stats->quick_bytes,
+			stats->largest_free, fragmentation);
+	fprintf(out, "\"sbrk_calls\": %llu, \"extends\": %llu, \"splits\": %llu, \"coalesces\": %llu, "
+			"\"remote_frees\": %llu, ",
+			(unsigned long long)stats->sbrk_calls, (unsigned long long)stats->extends,
+			(unsigned long long)stats->splits, (unsigned long long)stats->coalesces,
+			(unsigned long long)stats->remote_frees);
+
+	fputs("\"probes\": ", out);
+	printJsonArray(out, stats->probes, MM_PROBE_BUCKETS);
+	fputs(", \"slab_allocs\": ", out);
+	printJsonArray(out, stats->slab_allocs, MM_SLAB_CLASSES);
+	fputs(", \"slab_frees\": ", out);
+	printJsonArray(out, stats->slab_frees, MM_SLAB_CLASSES);
+
+	fputs(", \"bins\": [", out);
+	unsigned int i = 0;
+	int first = 1;
+	for(; i < MM_STATS_BINS; i++)
+	{
+		struct mm_bin_stats* bin = &stats->bins[i];
+		if( !bin->allocs && !bin->frees && !bin->free_blocks )
+			continue;
+
+		fprintf(out, "%s{\"index\": %u, \"min_size\": %zu, \"allocs\": %llu, \"frees\": %llu, "
+				"\"free_blocks\": %llu, \"free_bytes\": %llu}",
+				first ? "" : ", ", i, bin->min_size,
+				(unsigned long long)bin->allocs, (unsigned long long)bin->frees,
+				(unsigned long long)bin->free_blocks, (unsigned long long)bin->free_bytes);
+		first = 0;
+	}
+	fputs("]}\n", out);
+
+	free(stats);
+	return ferror(out) ? -1 : 0;
+}
+
+// check the subtree at node, hanging below parent: every
+// node is a free block of the list at index with the right
+// parent link, no red node has a red parent, and every path
+// down passes the same number of black nodes
+//
+// returns that number of black nodes, or -1 on an error
+static int check_subtree(struct tree_node* node, struct tree_node* parent, unsigned int index)
+{
+	if( !node )
+		return 0;
+
+	if( node->parent != parent || FREE != getAlloc((char*)node)
+			|| getIndex(getSize((char*)node)) != index )
+		return -1;
+	if( node->red && parent && parent->red )
+		return -1;
+
+	int left = check_subtree(node->child[0], node, index);
+	int right = check_subtree(node->child[1], node, index);
+	if( left < 0 || left != right )
+		return -1;
+
+	return left + !node->red;
+}
+
+
+// check the tree of the list at index: the red-black
+// properties, that an in order walk visits the blocks by
+// size and address, and that the statistics agree with it
+//
+// returns nonzero if the tree is consistent
+static int check_tree(struct arena* arena, unsigned int index)
+{
+	struct tree_node* root = (struct tree_node*)arena->array[index];
+	if( root && root->red )
+		return 0;
+	if( check_subtree(root, NULL, index) < 0 )
+		return 0;
+
+	uint64_t blocks = 0, bytes = 0;
+	struct tree_node* prev = NULL;
+	struct tree_node* node = treeFirst(root);
+	for(; node; prev = node, node = treeNext(node))
+	{
+		if( prev && !treeLess(prev, node) )
+			return 0;
+
+		blocks++;
+		bytes += getSize((char*)node);
 	}
 
+	return blocks == arena->stats.freeBlocks[index] && bytes == arena->stats.freeBytes[index];
+}
+
+
+// return whether the free block at bp is in the tree at root
+static int treeContains(struct tree_node* root, char* bp)
+{
+	struct tree_node* node = (struct tree_node*)bp;
+	while( root && root != node )
+		root = root->child[treeLess(root, node)];
+	return root == node;
 }
 
+
 /**********************************************************
- * mm_check
- * Check the consistency of the memory heap
- * Return nonzero if the heap is consistant.
+ * check_heap
+ * Check the consistency of one arena of the memory heap
+ * Return nonzero if the arena is consistant.
+ *
+ * The caller must hold the arena lock
  *********************************************************/
-int mm_check(void)
+static int check_heap(struct arena* arena)
 {
 	char* pBlock;
-	char* heapHigh = mem_heap_hi();
 
 	// Check if every block in free list marked as free?
 	// For each free list, iterate through all blocks
@@ -695,18 +4578,40 @@ int mm_check(void)
 	unsigned int i = 0;
 	for(; i < arrayLength; i++)
 	{
+		// The bitmap must agree with the list being empty
+		if( !arena->array[i] != !(arena->binmap[i >> 6] & (1ULL << (i & 63))) )
+			return 0;
+		if( !arena->binmap[i >> 6] != !(arena->binSummary & (1u << (i >> 6))) )
+			return 0;
+
+		if( i >= TREE_MIN_INDEX )
+		{
+			if( !check_tree(arena, i) )
+				return 0;
+			continue;
+		}
+
 		// Iterate through each free list until we get to the
 		// last block in the list
-		pBlock = array[i];
+		pBlock = arena->array[i];
 		char* saveFirstBlock = pBlock;
-		while( pBlock && getNext(pBlock) )
+		uint64_t blocks = 0, bytes = 0;
+		while( pBlock )
 		{
 			if( ALLOCATED == getAlloc(pBlock) )
 				return 0;
 
+			blocks++;
+			bytes += getSize(pBlock);
+			if( !getNext(pBlock) )
+				break;
 			pBlock = getNext(pBlock);
 		}
 
+		// The statistics must agree with what is on the list
+		if( blocks != arena->stats.freeBlocks[i] || bytes != arena->stats.freeBytes[i] )
+			return 0;
+
 		// Once we reach the last block, we want to see if we
 		// can then iterate backwards through the list
 		// and reach the first block in the list again
@@ -725,68 +4630,162 @@ int mm_check(void)
 			return 0;
 	}
 
-	// Iterate through the entire heap from start to finish,
-	// one block at a time, checking multiple things
+	// Every run on the lists of runs with free slots must
+	// be a flagged run page of the right class that really
+	// has free slots
+	for(i = 0; i < SLAB_CLASSES; i++)
+	{
+		struct run* run = arena->runs[i];
+		for(; run; run = run->next)
+		{
+			if( !isRunPage(run) || run->sizeClass != i || 0 == run->freeCount )
+				return 0;
+		}
+	}
+
+	// Every block on a quick-list must be an allocated heap
+	// block of the list's size owned by this arena
+	unsigned int quickBlocks = 0;
+	for(i = 0; i < QUICK_CLASSES; i++)
+	{
+		unsigned int count = 0;
+		char* data = arena->quick[i];
+		for(; data; data = quickGetNext(data), count++)
+		{
+			if( isRunPage(data) || getArena(data) != arena || quickIndex(getSize(data - 8)) != i
+				|| ALLOCATED != getAlloc(data - 8) || count >= arena->quickCount[i] )
+				return 0;
+		}
+
+		if( count != arena->quickCount[i] )
+			return 0;
+		quickBlocks += count;
+	}
+
+	if( quickBlocks != arena->quickBlocks )
+		return 0;
+
+	// Iterate through every segment of the arena from start
+	// to finish, one block at a time, checking multiple things
 	// (see comments inside the loop)
 	// pointers in heap block point to valid heap addresses?
-	// contiguous free blocks that escaped coalescing?
 	// every free block in free list?
-	pBlock = heapStart;
-	unsigned int consecutiveFreeBlocks = 0;
-
-	while( heapHigh != pBlock - 1)
+	struct segment* seg = arena->segments;
+	for(; seg; seg = seg->next)
 	{
-		if( FREE == getAlloc(pBlock) )
-		{
-			consecutiveFreeBlocks++;
+		char* segEnd = (char*)seg + seg->size;
+
+		if( getSegment(seg) != seg || getSegment(segEnd - 1) != seg )
+			return 0;
 
-			// For every free block we find in the heap,
-			// use the size to determine which free list
-			// it should be on, and iterate through that
-			// free list, looking for this block.
+		pBlock = (char*)(seg + 1);
+		enum Status prevStatus = ALLOCATED;			// the prologue
+		while( 0 != getSize(pBlock) )
+		{
+			// If, at any point, our pointer points to memory
+			// outside of the segment, return an error
 			//
-			// If we reach the end of the free list without
-			// finding it, return an error
-			unsigned int index = getIndex(getSize(pBlock));
-			char* pFreeListIter = array[index];
+			// This would indicate that a size field of a
+			// free or allocated block is incorrect
+			size_t size = getSize(pBlock);
+			if( pBlock + size > segEnd - 8 )
+				return 0;
+
+			if( FREE == getAlloc(pBlock) )
+			{
+				// For every free block we find in the heap,
+				// use the size to determine which free list
+				// it should be on, and iterate through that
+				// free list, looking for this block.
+				//
+				// If we reach the end of the free list without
+				// finding it, return an error
+				unsigned int index = getIndex(size);
+				char* pFreeListIter = arena->array[index];
 
-			while( pFreeListIter && pFreeListIter != pBlock )
-				pFreeListIter = getNext(pFreeListIter);
+				if( index >= TREE_MIN_INDEX )
+				{
+					if( !treeContains((struct tree_node*)pFreeListIter, pBlock) )
+						return 0;
+				}
+				else
+				{
+					while( pFreeListIter && pFreeListIter != pBlock )
+						pFreeListIter = getNext(pFreeListIter);
 
-			if( pFreeListIter != pBlock )
+					if( pFreeListIter != pBlock )
+						return 0;
+				}
+			}
+
+			// Check to see that the previous block bit in
+			// the header matches the block we just walked past
+			if( prevStatus != getPrevAlloc(pBlock) )
 				return 0;
-		}
 
-		// If we see 2 consecutive free blocks, they somehow
-		// escaped coalescing, and we return an error
-		if( 2 == consecutiveFreeBlocks )
-			return 0;
+			// Check to see that no two neighbouring blocks
+			// are both free, they should have been coalesced
+			if( FREE == prevStatus && FREE == getAlloc(pBlock) )
+				return 0;
 
-		// If, at any point, our pointer points to memory
-		// outside of the heap, return an error
-		//
-		// This would indicate that a size field of a
-		// free or allocated block is incorrect
-		if( pBlock < heapStart || pBlock > heapHigh )
-			return 0;
+			// Check to see that the size and allocated fields
+			// in the header of a free block match its footer,
+			// allocated blocks have none
+			enum Status status = getAlloc(pBlock);
+			if( FREE == status && size != getSize(pBlock + size - 8) )
+				return 0;
+			if( FREE == status && FREE != getAlloc(pBlock + size - 8) )
+				return 0;
 
-		// Check to see that the size field in the
-		// header of a block matches the field in the
-		// footer
-		unsigned int size = getSize(pBlock);
-		if( size != getSize(pBlock + size - 8) )
-			return 0;
+			// For a slab run, check that the free count
+			// agrees with the bitmap and its capacity.  The
+			// block may keep a tail too small to split off
+			if( ALLOCATED == status && isRunPage(pBlock + 8) )
+			{
+				struct run* run = getRun(pBlock + 8);
+				unsigned int freeSlots = 0;
+				unsigned int w = 0;
+				for(; w < sizeof(run->bitmap) / sizeof(run->bitmap[0]); w++)
+					freeSlots += __builtin_popcountll(run->bitmap[w]);
 
-		// Check to see that the allocated field in the
-		// header of a block matches the field in the
-		// footer
-		enum Status status = getAlloc(pBlock);
-		if( status != getAlloc(pBlock + size - 8) )
-			return 0;
+				if( size < RUN_BLOCK_SIZE || size >= RUN_BLOCK_SIZE + MIN_BLOCK_SIZE )
+					return 0;
+				if( freeSlots != run->freeCount )
+					return 0;
+				if( run->capacity != (PAGE_BYTES - RUN_HEADER_SIZE) / slabObjectSize(run->sizeClass) )
+					return 0;
+			}
 
-		pBlock = getNext(pBlock);
+			prevStatus = status;
+			pBlock += size;
+		}
+
+		// The walk must end on the epilogue
+		if( pBlock != segEnd - 8 || ALLOCATED != getAlloc(pBlock) )
+			return 0;
+		if( prevStatus != getPrevAlloc(pBlock) )
+			return 0;
 	}
 
 	return 1;
 }
 
+/**********************************************************
+ * mm_check
+ * Check the consistency of the memory heap
+ * Return nonzero if the heap is consistant.
+ *********************************************************/
+int mm_check(void)
+{
+	int consistent = 1;
+
+	unsigned int a = 0;
+	for(; a < numArenas && consistent; a++)
+	{
+		pthread_mutex_lock(&arenas[a].lock);
+		consistent = check_heap(&arenas[a]);
+		pthread_mutex_unlock(&arenas[a].lock);
+	}
+
+	return consistent;
+}
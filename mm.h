@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int mm_init (void);
+extern void *mm_malloc (size_t size);
+extern void mm_free (void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern int mm_check(void);
+
+/* Zeroed allocation, skipping memory known to be zero */
+extern void *mm_calloc(size_t nmemb, size_t size);
+
+/* Aligned allocation, alignment must be a power of two */
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/* Free with the size the block was allocated with, skipping its header */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* Thread cache class of a request size, MM_SIZE_CLASSES if it has none.
+   A constant size gives a constant class, so callers that know their
+   size at compile time skip working it out on every call */
+#define MM_SIZE_CLASSES     64
+#define MM_SIZE_CLASS(size) \
+    ((size) == 0 ? MM_SIZE_CLASSES : \
+     (size) <= 256 ? ((size) + 15) / 16 - 1 : \
+     (size) <= 1016 ? ((size) + 23) / 16 - 1 : MM_SIZE_CLASSES)
+
+/* mm_malloc and mm_free_sized for a class given as MM_SIZE_CLASS(size) */
+extern void *mm_malloc_class(size_t size, unsigned int cls);
+extern void mm_free_class(void *ptr, unsigned int cls);
+
+/* Bytes of data the block can hold, at least its requested size */
+extern size_t mm_usable_size(void *ptr);
+
+/* Many blocks of one size at once, mm_free_batch sorts ptrs by address */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Private heaps, freed all at once by mm_heap_reset or mm_heap_destroy.
+   Their blocks are freed with mm_heap_free only, never with mm_free */
+#define MM_HEAP_GENERAL	0	/* blocks are freed one at a time and reused, locked */
+#define MM_HEAP_BUMP	1	/* blocks are carved in order and only a reset frees them, unlocked */
+struct mm_heap;
+extern struct mm_heap *mm_heap_create(int mode);
+extern void *mm_heap_malloc(struct mm_heap *heap, size_t size);
+extern void mm_heap_free(struct mm_heap *heap, void *ptr);
+extern void mm_heap_reset(struct mm_heap *heap);
+extern void mm_heap_destroy(struct mm_heap *heap);
+
+/* Arena configuration, takes effect at the next mm_init */
+#define MM_ARENA_ROUND_ROBIN	0	/* threads take arenas in turn on first use */
+#define MM_ARENA_PER_CPU		1	/* threads use the arena of their current CPU */
+extern void mm_set_arenas(unsigned int count, int policy);
+
+/* Requests of at least this many bytes get their own mapping, SIZE_MAX disables */
+extern void mm_set_mmap_threshold(size_t bytes);
+
+/* Grow and trim the heap in 2 MiB transparent huge pages, takes effect at the next mm_init */
+extern void mm_set_huge_pages(int enable);
+
+/* Heap bytes backed by transparent huge pages, read from /proc/self/smaps */
+extern size_t mm_huge_bytes(void);
+
+/* Per-thread cache tuning */
+extern void mm_tcache_set_capacity(size_t size, unsigned int capacity);
+extern void mm_tcache_flush(void);
+
+/* Freed blocks of one size an arena keeps without coalescing, 0 disables */
+extern void mm_set_quick_limit(unsigned int blocks);
+
+/* Sampling heap profiler, writing heap profiles pprof can read */
+extern void mm_set_sample_rate(size_t bytes);   /* mean bytes between samples, 0 disables */
+extern int mm_profile_dump(const char *path);
+extern int mm_profile_signal(int signo, const char *prefix);
+
+/* Handlers for pthread_atfork, keeping the heap usable in a forked child */
+extern void mm_fork_prepare(void);
+extern void mm_fork_parent(void);
+extern void mm_fork_child(void);
+
+/* Runtime statistics, see mm_stats */
+#define MM_STATS_BINS       344  /* free lists in an arena */
+#define MM_SLAB_CLASSES     16   /* slab object sizes, 16 to 256 bytes */
+#define MM_PROBE_BUCKETS    10   /* find_fit probes: 0, 1, 2, 3-4, 5-8, ..., 129 and more */
+
+struct mm_bin_stats {
+    size_t min_size;         /* smallest block size on the free list */
+    uint64_t allocs;         /* requests for blocks of this list's sizes */
+    uint64_t frees;          /* blocks of this list's sizes freed */
+    uint64_t free_blocks;    /* blocks on the free list now */
+    uint64_t free_bytes;     /* bytes on the free list now */
+};
+
+struct mm_stats {
+    size_t heap_bytes;       /* bytes taken from mem_sbrk */
+    size_t mapped_bytes;     /* bytes in direct mappings */
+    size_t in_use_bytes;     /* heap and mapped bytes not free or on quick-lists */
+    size_t free_bytes;       /* bytes in free blocks on the free lists */
+    size_t quick_bytes;      /* bytes in blocks on quick-lists */
+    size_t largest_free;     /* largest free block */
+    uint64_t mapped_blocks;  /* live direct mappings */
+    uint64_t sbrk_calls;     /* mem_sbrk calls */
+    uint64_t extends;        /* times an arena ran out of free blocks */
+    uint64_t splits;         /* blocks split in two */
+    uint64_t coalesces;      /* free neighbours merged */
+    uint64_t remote_frees;   /* blocks freed by other threads through remote lists */
+    uint64_t probes[MM_PROBE_BUCKETS];     /* find_fit calls by blocks looked at */
+    uint64_t slab_allocs[MM_SLAB_CLASSES];
+    uint64_t slab_frees[MM_SLAB_CLASSES];
+    struct mm_bin_stats bins[MM_STATS_BINS];
+};
+extern void mm_stats(struct mm_stats *stats);
+extern int mm_stats_json(FILE *out);
+
+/* Giving unused memory back to the system */
+struct mm_purge_stats {
+    size_t purged;      /* bytes of free block pages given back with madvise */
+    size_t purges;      /* madvise calls made */
+    size_t trimmed;     /* bytes given back by moving the break down */
+};
+extern size_t mm_trim(void);
+extern void mm_set_decay_time(long milliseconds);
+extern void mm_get_purge_stats(struct mm_purge_stats *stats);
+
+
+/*
+ * Students work in teams of one or two.  Teams enter their team name,
+ * personal names and login IDs in a struct of this
+ * type in their mm.c file.
+ */
+typedef struct {
+    char *teamname; /* ID1+ID2 or ID1 */
+    char *name1;    /* full name of first member */
+    char *id1;      /* login ID of first member */
+    char *name2;    /* full name of second member (if any) */
+    char *id2;      /* login ID of second member */
+} team_t;
+
+extern team_t team;
+
+#ifdef __cplusplus
+}
+#endif
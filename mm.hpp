@@ -0,0 +1,148 @@
+/*
+ * mm.hpp - the mm package for C++ containers
+ *
+ *   mm::memory_resource   a std::pmr::memory_resource on mm_malloc,
+ *                         returned by mm::get_memory_resource()
+ *   mm::allocator<T>      a stateless allocator for std containers
+ *   mm::malloc_fixed<N>   allocation of a size known at compile time,
+ *   mm::free_fixed<N>     with its thread cache class worked out then
+ *
+ * Every resource and allocator draws on the same heap, so all of them
+ * compare equal and memory allocated through one may be freed through
+ * any other.  Frees pass the size back, as mm_free_sized does, so the
+ * block's header is not read.  Alignments above 16 bytes go through
+ * mm_memalign.  mm_init must have been called before any of them is
+ * used.  Allocation failure throws std::bad_alloc.
+ */
+#ifndef MM_HPP
+#define MM_HPP
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "mm.h"
+
+namespace mm {
+
+/* alignment of every block mm_malloc returns */
+constexpr std::size_t min_alignment = 16;
+
+template <std::size_t Size>
+inline void *malloc_fixed()
+{
+    static_assert(Size > 0, "zero-sized blocks have no class");
+    constexpr unsigned int cls = MM_SIZE_CLASS(Size);
+
+    void *p = mm_malloc_class(Size, cls);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+template <std::size_t Size>
+inline void free_fixed(void *p) noexcept
+{
+    constexpr unsigned int cls = MM_SIZE_CLASS(Size);
+    mm_free_class(p, cls);
+}
+
+/* allocate bytes aligned to alignment, or throw */
+inline void *allocate(std::size_t bytes, std::size_t alignment)
+{
+    if (bytes == 0)
+        bytes = 1;
+
+    void *p = alignment <= min_alignment ? mm_malloc(bytes) : mm_memalign(alignment, bytes);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+inline void deallocate(void *p, std::size_t bytes, std::size_t alignment) noexcept
+{
+    /* an aligned block may have been carved from a larger one */
+    if (alignment <= min_alignment)
+        mm_free_sized(p, bytes);
+    else
+        mm_free(p);
+}
+
+class memory_resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return mm::allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+        mm::deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return dynamic_cast<const memory_resource *>(&other) != nullptr;
+    }
+};
+
+/* the resource every std::pmr container on the mm heap can share */
+inline memory_resource *get_memory_resource() noexcept
+{
+    static memory_resource resource;
+    return &resource;
+}
+
+/*
+ * A single object, as node-based containers allocate, takes the
+ * compile-time class of sizeof(T); arrays go through mm_malloc
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+            throw std::bad_array_new_length();
+
+        if constexpr (alignof(T) <= min_alignment) {
+            if (n == 1)
+                return static_cast<T *>(malloc_fixed<sizeof(T)>());
+        }
+        return static_cast<T *>(mm::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        if constexpr (alignof(T) <= min_alignment) {
+            if (n == 1) {
+                free_fixed<sizeof(T)>(p);
+                return;
+            }
+        }
+        mm::deallocate(p, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+inline bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return false;
+}
+
+} /* namespace mm */
+
+#endif /* MM_HPP */
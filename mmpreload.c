@@ -0,0 +1,304 @@
+/*
+ * mmpreload.c - the mm package as a drop-in replacement for the C
+ *               library allocator, built into libmm.so by make
+ *
+ *     LD_PRELOAD=./libmm.so program ...
+ *
+ * runs an unmodified, dynamically linked program on mm_malloc and
+ * friends.  The simulated heap of memlib.c is replaced by one large
+ * reserved mapping that the break moves through, so the allocator
+ * uses real memory the way it uses the driver's heap.
+ *
+ * The heap is set up on the first call into the allocator.  Calls the
+ * initializing thread makes while mm_init runs are served from a small
+ * static buffer, and pthread_atfork handlers keep the allocator's locks
+ * consistent across fork.  The library is built with the initial-exec
+ * TLS model, so the thread cache is reached without __tls_get_addr,
+ * which may itself allocate.
+ *
+ * Setting MM_HUGE_PAGES in the environment backs the heap with
+ * transparent huge pages (see mm_set_huge_pages).
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define HEAP_RESERVE  ((size_t)1 << 40)  /* address space reserved for the heap */
+#define HEAP_MIN      ((size_t)1 << 30)  /* smallest reservation worth using */
+#define BOOTSTRAP     (64 * 1024)        /* static memory for calls made by mm_init */
+
+/* private variables */
+static char *heap_start;     /* first byte of the reservation */
+static char *heap_brk;       /* current break */
+static char *heap_end;       /* end of the reservation */
+
+static int state;            /* 0 before, 1 during and 2 after set up */
+static __thread int setting_up;
+static _Alignas(16) char bootstrap[BOOTSTRAP];
+static size_t bootstrap_used;
+
+
+/*
+ * mem_init - reserve the heap, halving the request until the
+ *    kernel agrees, as it may when overcommit is turned off
+ */
+void mem_init(void)
+{
+    size_t size;
+
+    for (size = HEAP_RESERVE; size >= HEAP_MIN; size /= 2) {
+        heap_start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (heap_start != MAP_FAILED)
+            break;
+    }
+    if (size < HEAP_MIN)
+        abort();
+
+    heap_brk = heap_start;
+    heap_end = heap_start + size;
+}
+
+/*
+ * mem_deinit - the heap lives as long as the process
+ */
+void mem_deinit(void)
+{
+}
+
+/*
+ * mem_reset_brk - the heap is never reset under a running program
+ */
+void mem_reset_brk(void)
+{
+}
+
+/*
+ * mem_sbrk - move the break by incr bytes and return the old
+ *    break, giving back the pages a negative incr releases.  The
+ *    allocator calls it with its sbrk lock held
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    char *old_brk = heap_brk;
+
+    if ((incr < 0 && -incr > heap_brk - heap_start) ||
+        (incr > 0 && incr > heap_end - heap_brk)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    heap_brk += incr;
+
+    if (incr < 0) {
+        size_t pagesize = mem_pagesize();
+        char *start = (char *)(((uintptr_t)heap_brk + pagesize - 1) & ~(pagesize - 1));
+        if (start < old_brk)
+            madvise(start, old_brk - start, MADV_DONTNEED);
+    }
+
+    return (void *)old_brk;
+}
+
+void *mem_heap_lo(void)
+{
+    return (void *)heap_start;
+}
+
+void *mem_heap_hi(void)
+{
+    return (void *)(heap_brk - 1);
+}
+
+size_t mem_heapsize(void)
+{
+    return (size_t)(heap_brk - heap_start);
+}
+
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
+
+
+/*
+ * bootstrap_malloc - hand out static memory to calls made while
+ *    the heap is being set up, each with its size in front
+ */
+static void *bootstrap_malloc(size_t size)
+{
+    size_t need = 16 + ((size + 15) & ~(size_t)15);
+
+    if (size > BOOTSTRAP || need > BOOTSTRAP - bootstrap_used)
+        return NULL;
+
+    char *p = bootstrap + bootstrap_used;
+    bootstrap_used += need;
+    *(size_t *)p = size;
+    return p + 16;
+}
+
+static int is_bootstrap(void *ptr)
+{
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP;
+}
+
+/*
+ * ready - set the heap up on the first call, and return 0 while
+ *    the calling thread is the one doing it
+ */
+static int ready(void)
+{
+    if (__builtin_expect(__atomic_load_n(&state, __ATOMIC_ACQUIRE) == 2, 1))
+        return 1;
+    if (setting_up)
+        return 0;
+
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&state, &expected, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        setting_up = 1;
+        mem_init();
+        if (getenv("MM_HUGE_PAGES"))
+            mm_set_huge_pages(1);
+        if (mm_init() < 0)
+            abort();
+        __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+        pthread_atfork(mm_fork_prepare, mm_fork_parent, mm_fork_child);
+        setting_up = 0;
+        return 1;
+    }
+
+    /* another thread is setting the heap up */
+    while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2)
+        sched_yield();
+    return 1;
+}
+
+__attribute__((constructor))
+static void preload_init(void)
+{
+    ready();
+}
+
+
+EXPORT void *malloc(size_t size)
+{
+    if (!ready())
+        return bootstrap_malloc(size);
+
+    /* malloc(0) gives a unique pointer, as the C library's does */
+    void *p = mm_malloc(size ? size : 1);
+    if (!p)
+        errno = ENOMEM;
+    return p;
+}
+
+EXPORT void free(void *ptr)
+{
+    if (!ptr || is_bootstrap(ptr))
+        return;
+    mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* bootstrap memory is static, so already zero */
+    if (!ready())
+        return bootstrap_malloc(bytes);
+
+    void *p = mm_calloc(1, bytes ? bytes : 1);
+    if (!p)
+        errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr && is_bootstrap(ptr)) {
+        void *p = malloc(size);
+        size_t old = *(size_t *)((char *)ptr - 16);
+        if (p)
+            memcpy(p, ptr, old < size ? old : size);
+        return p;
+    }
+
+    if (!ready())
+        return bootstrap_malloc(size);
+
+    if (!ptr)
+        return malloc(size);
+
+    void *p = mm_realloc(ptr, size);
+    if (!p && size)
+        errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t bytes;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, bytes);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (!ready())
+        return ENOMEM;
+    return mm_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    if (!ready())
+        return NULL;
+
+    void *p = mm_memalign(alignment, size ? size : 1);
+    if (!p && errno != EINVAL)
+        errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(getpagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t pagesize = getpagesize();
+    return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    if (ptr && is_bootstrap(ptr))
+        return *(size_t *)((char *)ptr - 16);
+    return mm_usable_size(ptr);
+}
@@ -0,0 +1,388 @@
+/*
+ * mtbench - multi-threaded benchmarks for the mm package against libc
+ *
+ * Each benchmark runs with 1, 2, 4, ... up to the maximum number of
+ * threads, once on mm_malloc/mm_free and once on malloc/free, and
+ * reports the throughput of both along with the speedup over one
+ * thread, giving a scalability curve for each package.
+ *
+ *   larson    Larson-style server: every thread replaces random blocks
+ *             in its own set, then hands the set over to a new thread,
+ *             which frees blocks it did not allocate
+ *   prodcons  producer/consumer pairs: one thread allocates, and the
+ *             other frees every block it receives
+ *   churn     threads are created, allocate a little, pass some blocks
+ *             on to the next thread and exit, over and over
+ *
+ * -a sets the number of arenas mm_init creates (one per CPU by
+ * default), handed out round-robin, so a machine with few CPUs can
+ * still run threads on arenas of their own.
+ *
+ * usage: mtbench [-t maxthreads] [-s scale] [-a arenas] [benchmark ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS     64
+
+#define LARSON_SLOTS    1000    /* blocks each larson thread holds */
+#define LARSON_ROUNDS   4       /* hand-overs per larson slot set */
+#define LARSON_OPS      200000  /* replacements per larson round */
+
+#define RING_SIZE       1024    /* blocks in flight per producer/consumer pair */
+#define PRODCONS_OPS    1000000 /* blocks per producer */
+
+#define CHURN_THREADS   500     /* threads created per churn slot */
+#define CHURN_OPS       200     /* allocations per churn thread */
+#define CHURN_PASS      16      /* blocks passed on to the next churn thread */
+
+struct allocator {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+};
+
+static void *lib_malloc(size_t size) { return malloc(size); }
+static void lib_free(void *ptr) { free(ptr); }
+
+static struct allocator allocators[] = {
+    { "mm", mm_malloc, mm_free },
+    { "libc", lib_malloc, lib_free },
+};
+
+static const struct allocator *alloc;  /* allocator under test */
+static int scale = 1;                  /* multiplies every op count */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned int next_random(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static void *xmalloc(size_t size)
+{
+    char *p = alloc->malloc(size);
+    if (!p) {
+        fprintf(stderr, "mtbench: %s malloc of %zu bytes failed\n", alloc->name, size);
+        exit(1);
+    }
+    p[0] = (char)size;  /* touch the block like a real program would */
+    return p;
+}
+
+static pthread_t spawn(void *(*fn)(void *), void *arg)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fn, arg)) {
+        fprintf(stderr, "mtbench: pthread_create failed\n");
+        exit(1);
+    }
+    return tid;
+}
+
+
+/****************
+ * Larson server
+ ****************/
+
+struct larson {
+    void *slots[LARSON_SLOTS];
+    unsigned int seed;
+    int rounds;  /* hand-overs left */
+};
+
+static void *larson_thread(void *arg)
+{
+    struct larson *l = arg;
+    int i;
+
+    for (i = 0; i < LARSON_OPS * scale; i++) {
+        unsigned int r = next_random(&l->seed);
+        int slot = r % LARSON_SLOTS;
+        alloc->free(l->slots[slot]);
+        l->slots[slot] = xmalloc(16 + (r >> 10) % 497);
+    }
+
+    /* hand the blocks over to a new thread, as a server does
+       when one connection ends and another starts */
+    if (--l->rounds > 0)
+        pthread_join(spawn(larson_thread, l), NULL);
+    return NULL;
+}
+
+static double larson(int threads)
+{
+    struct larson *sets = calloc(threads, sizeof(*sets));
+    pthread_t tids[MAX_THREADS];
+    int t, i;
+
+    for (t = 0; t < threads; t++) {
+        sets[t].seed = t + 1;
+        sets[t].rounds = LARSON_ROUNDS;
+        for (i = 0; i < LARSON_SLOTS; i++)
+            sets[t].slots[i] = xmalloc(16 + next_random(&sets[t].seed) % 497);
+    }
+
+    double start = now();
+    for (t = 0; t < threads; t++)
+        tids[t] = spawn(larson_thread, &sets[t]);
+    for (t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    double secs = now() - start;
+
+    for (t = 0; t < threads; t++)
+        for (i = 0; i < LARSON_SLOTS; i++)
+            alloc->free(sets[t].slots[i]);
+    free(sets);
+
+    return (double)threads * LARSON_ROUNDS * LARSON_OPS * scale / secs;
+}
+
+
+/********************
+ * Producer/consumer
+ ********************/
+
+/* single producer, single consumer ring of blocks */
+struct ring {
+    void *blocks[RING_SIZE];
+    unsigned long head;  /* next slot the producer fills */
+    char pad[64];
+    unsigned long tail;  /* next slot the consumer empties */
+    unsigned int seed;
+};
+
+static void *producer_thread(void *arg)
+{
+    struct ring *ring = arg;
+    unsigned long i;
+
+    for (i = 0; i < (unsigned long)PRODCONS_OPS * scale; i++) {
+        void *p = xmalloc(16 + next_random(&ring->seed) % 1009);
+        while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE)
+            sched_yield();
+        ring->blocks[i % RING_SIZE] = p;
+        __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *arg)
+{
+    struct ring *ring = arg;
+    unsigned long i;
+
+    for (i = 0; i < (unsigned long)PRODCONS_OPS * scale; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == i)
+            sched_yield();
+        alloc->free(ring->blocks[i % RING_SIZE]);
+        __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* threads is rounded up to a whole number of pairs */
+static double prodcons(int threads)
+{
+    int pairs = (threads + 1) / 2;
+    struct ring *rings = calloc(pairs, sizeof(*rings));
+    pthread_t tids[2 * MAX_THREADS];
+    int p;
+
+    double start = now();
+    for (p = 0; p < pairs; p++) {
+        rings[p].seed = p + 1;
+        tids[2 * p] = spawn(producer_thread, &rings[p]);
+        tids[2 * p + 1] = spawn(consumer_thread, &rings[p]);
+    }
+    for (p = 0; p < 2 * pairs; p++)
+        pthread_join(tids[p], NULL);
+    double secs = now() - start;
+
+    free(rings);
+    return (double)pairs * PRODCONS_OPS * scale * 2 / secs;
+}
+
+
+/***************
+ * Thread churn
+ ***************/
+
+struct churn {
+    void *passed[CHURN_PASS];  /* blocks left by the previous thread */
+    unsigned int seed;
+};
+
+static void *churn_thread(void *arg)
+{
+    struct churn *c = arg;
+    void *blocks[CHURN_OPS];
+    int i;
+
+    for (i = 0; i < CHURN_PASS; i++)
+        alloc->free(c->passed[i]);
+    for (i = 0; i < CHURN_OPS; i++)
+        blocks[i] = xmalloc(16 + next_random(&c->seed) % 2033);
+    for (i = 0; i < CHURN_OPS - CHURN_PASS; i++)
+        alloc->free(blocks[i]);
+    memcpy(c->passed, blocks + CHURN_OPS - CHURN_PASS, sizeof(c->passed));
+    return NULL;
+}
+
+static void *churn_slot(void *arg)
+{
+    int i;
+    for (i = 0; i < CHURN_THREADS * scale; i++)
+        pthread_join(spawn(churn_thread, arg), NULL);
+    return NULL;
+}
+
+static double churn(int threads)
+{
+    struct churn *slots = calloc(threads, sizeof(*slots));
+    pthread_t tids[MAX_THREADS];
+    int t, i;
+
+    double start = now();
+    for (t = 0; t < threads; t++) {
+        slots[t].seed = t + 1;
+        tids[t] = spawn(churn_slot, &slots[t]);
+    }
+    for (t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    double secs = now() - start;
+
+    for (t = 0; t < threads; t++)
+        for (i = 0; i < CHURN_PASS; i++)
+            alloc->free(slots[t].passed[i]);
+    free(slots);
+
+    return (double)threads * CHURN_THREADS * scale * (CHURN_OPS * 2) / secs;
+}
+
+
+struct benchmark {
+    const char *name;
+    double (*run)(int threads);  /* returns malloc and free calls per second */
+};
+
+static struct benchmark benchmarks[] = {
+    { "larson", larson },
+    { "prodcons", prodcons },
+    { "churn", churn },
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void run_benchmark(const struct benchmark *b, int maxthreads)
+{
+    double base[2] = { 0, 0 };
+    int threads;
+    int a;
+
+    printf("\n%s\n", b->name);
+    printf("%8s %12s %8s %12s %8s %8s\n", "threads", "mm Mops/s", "speedup",
+           "libc Mops/s", "speedup", "mm/libc");
+
+    for (threads = 1; ; threads *= 2) {
+        if (threads > maxthreads)
+            threads = maxthreads;
+
+        double rate[2];
+        for (a = 0; a < 2; a++) {
+            alloc = &allocators[a];
+            if (alloc->malloc == mm_malloc) {
+                mem_reset_brk();
+                if (mm_init() < 0) {
+                    fprintf(stderr, "mtbench: mm_init failed\n");
+                    exit(1);
+                }
+            }
+            rate[a] = b->run(threads);
+            if (threads == 1)
+                base[a] = rate[a];
+        }
+
+        printf("%8d %12.2f %8.2f %12.2f %8.2f %8.2f\n", threads,
+               rate[0] / 1e6, rate[0] / base[0],
+               rate[1] / 1e6, rate[1] / base[1], rate[0] / rate[1]);
+
+        if (threads == maxthreads)
+            break;
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mtbench [-t maxthreads] [-s scale] [-a arenas] [larson|prodcons|churn ...]\n");
+}
+
+int main(int argc, char **argv)
+{
+    int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+    unsigned int i;
+
+    while ((c = getopt(argc, argv, "t:s:a:h")) != -1) {
+        switch (c) {
+        case 't':
+            maxthreads = atoi(optarg);
+            break;
+        case 's':
+            scale = atoi(optarg);
+            break;
+        case 'a':
+            mm_set_arenas(atoi(optarg), MM_ARENA_ROUND_ROBIN);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (maxthreads < 1)
+        maxthreads = 1;
+    if (maxthreads > MAX_THREADS)
+        maxthreads = MAX_THREADS;
+    if (scale < 1)
+        scale = 1;
+
+    mem_init();
+    printf("Threads 1..%d, scale %d\n", maxthreads, scale);
+
+    if (optind == argc) {
+        for (i = 0; i < NUM_BENCHMARKS; i++)
+            run_benchmark(&benchmarks[i], maxthreads);
+        return 0;
+    }
+
+    for (; optind < argc; optind++) {
+        for (i = 0; i < NUM_BENCHMARKS; i++)
+            if (!strcmp(argv[optind], benchmarks[i].name))
+                break;
+        if (i == NUM_BENCHMARKS) {
+            usage();
+            exit(1);
+        }
+        run_benchmark(&benchmarks[i], maxthreads);
+    }
+    return 0;
+}
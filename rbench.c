@@ -0,0 +1,133 @@
+/*
+ * rbench - count the copies made by mm_realloc against the C library
+ *
+ * Each pattern grows or shrinks a set of buffers step by step, and a
+ * realloc is counted as a copy whenever the block comes back at a new
+ * address, in which case all of its old data had to move.  Every pattern
+ * stays below the mmap threshold, since a mapping that mremap moves to
+ * a new address has its pages moved rather than copied.
+ *
+ * usage: rbench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define BUFFERS 8
+
+typedef void* (*realloc_fn)(void*, size_t);
+typedef void (*free_fn)(void*);
+
+struct result {
+	unsigned long reallocs;
+	unsigned long moves;
+	unsigned long long bytesCopied;
+	double seconds;
+};
+
+struct pattern {
+	const char* name;
+	size_t start;      /* first size of every buffer */
+	size_t step;       /* bytes added (or removed) per realloc */
+	int steps;         /* reallocs per buffer */
+	int shrink;        /* walk the sizes back down afterwards */
+	int buffers;       /* buffers grown in turn, interleaved */
+};
+
+static struct pattern patterns[] = {
+	{ "append 16 B, 1 buffer",      16,   16, 2000, 0, 1 },
+	{ "append 100 B, 1 buffer",     16,  100, 2000, 0, 1 },
+	{ "append 100 B, 8 buffers",    16,  100, 2000, 0, BUFFERS },
+	{ "append 4 KiB, 8 buffers",  4096, 4096,   60, 0, BUFFERS },
+	{ "grow then shrink, 1 buffer", 16,  100, 2000, 1, 1 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* lib_realloc(void* ptr, size_t size) { return realloc(ptr, size); }
+static void lib_free(void* ptr) { free(ptr); }
+
+/* resize every buffer of the pattern to size, counting moves */
+static void resize_all(struct pattern* p, char** buf, size_t* len, size_t size,
+		       realloc_fn re, struct result* r)
+{
+	for (int b = 0; b < p->buffers; b++) {
+		char* q = re(buf[b], size);
+		if (!q) {
+			fprintf(stderr, "rbench: out of memory at %zu bytes\n", size);
+			exit(1);
+		}
+		r->reallocs++;
+		if (q != buf[b]) {
+			r->moves++;
+			r->bytesCopied += len[b] < size ? len[b] : size;
+		}
+		/* touch the new bytes so a lazy copy cannot hide */
+		if (size > len[b])
+			memset(q + len[b], b, size - len[b]);
+		buf[b] = q;
+		len[b] = size;
+	}
+}
+
+static void run(struct pattern* p, realloc_fn re, free_fn fr, struct result* r)
+{
+	char* buf[BUFFERS] = { NULL };
+	size_t len[BUFFERS] = { 0 };
+	size_t size = p->start;
+
+	memset(r, 0, sizeof(*r));
+	double begin = now();
+
+	resize_all(p, buf, len, size, re, r);
+	r->reallocs = r->moves = r->bytesCopied = 0;
+
+	for (int i = 0; i < p->steps; i++) {
+		size += p->step;
+		resize_all(p, buf, len, size, re, r);
+	}
+	if (p->shrink) {
+		for (int i = 0; i < p->steps; i++) {
+			size -= p->step;
+			resize_all(p, buf, len, size, re, r);
+		}
+	}
+
+	r->seconds = now() - begin;
+	for (int b = 0; b < p->buffers; b++)
+		fr(buf[b]);
+}
+
+int main(void)
+{
+	mem_init();
+	if (mm_init() < 0) {
+		fprintf(stderr, "rbench: mm_init failed\n");
+		exit(1);
+	}
+
+	printf("%-28s %10s %9s %12s %9s %9s %12s %9s\n", "pattern", "reallocs",
+	       "mm moves", "mm copied", "mm secs", "lib moves", "lib copied", "lib secs");
+
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		struct result mm, lib;
+		run(&patterns[i], mm_realloc, mm_free, &mm);
+		run(&patterns[i], lib_realloc, lib_free, &lib);
+
+		printf("%-28s %10lu %9lu %12llu %9.4f %9lu %12llu %9.4f\n", patterns[i].name,
+		       mm.reallocs, mm.moves, mm.bytesCopied, mm.seconds,
+		       lib.moves, lib.bytesCopied, lib.seconds);
+	}
+
+	return 0;
+}
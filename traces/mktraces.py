@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""
+mktraces.py - generate the bundled trace files for mdriver
+
+Each trace exercises one allocation pattern, and every block that
+is allocated is freed again by the end of the trace ("-bal").  The
+traces are generated from fixed seeds, so running this script again
+reproduces them exactly:
+
+    cd traces && ./mktraces.py
+
+Trace file format (see read_trace in mdriver.c):
+    <suggested heap size>
+    <number of block ids>
+    <number of requests>
+    <weight>
+    a <id> <bytes>      allocate
+    r <id> <bytes>      reallocate
+    f <id>              free
+"""
+import random
+
+
+class Trace:
+    def __init__(self):
+        self.ops = []
+        self.next_id = 0
+        self.live = {}
+
+    def alloc(self, size):
+        block = self.next_id
+        self.next_id += 1
+        self.ops.append("a %d %d" % (block, size))
+        self.live[block] = size
+        return block
+
+    def realloc(self, block, size):
+        self.ops.append("r %d %d" % (block, size))
+        self.live[block] = size
+
+    def free(self, block):
+        self.ops.append("f %d" % block)
+        del self.live[block]
+
+    def free_all(self, rng=None):
+        blocks = sorted(self.live)
+        if rng:
+            rng.shuffle(blocks)
+        for block in blocks:
+            self.free(block)
+
+    def write(self, name):
+        assert not self.live, name
+        with open(name, "w") as f:
+            f.write("20000000\n%d\n%d\n1\n" % (self.next_id, len(self.ops)))
+            f.write("\n".join(self.ops) + "\n")
+
+
+def short1():
+    t = Trace()
+    a = t.alloc(2040)
+    b = t.alloc(2040)
+    t.free(b)
+    c = t.alloc(48)
+    d = t.alloc(4072)
+    t.free(d)
+    e = t.alloc(4072)
+    t.free(a)
+    t.free(c)
+    f = t.alloc(4072)
+    t.free(e)
+    t.free(f)
+    return t
+
+
+def short2():
+    t = Trace()
+    sizes = [4095, 57, 1, 16, 8190, 300, 2000, 32, 4096, 5]
+    blocks = [t.alloc(s) for s in sizes]
+    for block in blocks[::2]:
+        t.free(block)
+    blocks = [t.alloc(s // 2 + 1) for s in sizes[::2]]
+    t.free_all()
+    return t
+
+
+def binary(small, large, bigger, pairs):
+    # alternate small and large blocks, free the large ones, then ask
+    # for blocks slightly bigger than the holes they left
+    t = Trace()
+    larges = []
+    for i in range(pairs):
+        t.alloc(small)
+        larges.append(t.alloc(large))
+    for block in larges:
+        t.free(block)
+    for i in range(pairs):
+        t.alloc(bigger)
+    t.free_all()
+    return t
+
+
+def coalescing(rounds):
+    t = Trace()
+    for i in range(rounds):
+        a = t.alloc(4095)
+        b = t.alloc(4095)
+        t.free(a)
+        t.free(b)
+        c = t.alloc(8190)
+        t.free(c)
+    return t
+
+
+def random_sizes(seed, requests, live_max, size_of):
+    rng = random.Random(seed)
+    t = Trace()
+    for i in range(requests):
+        if t.live and (len(t.live) >= live_max or rng.random() < 0.45):
+            t.free(rng.choice(list(t.live)))
+        else:
+            t.alloc(size_of(rng))
+    t.free_all(rng)
+    return t
+
+
+def churn(seed, requests):
+    # a steady working set of a few hot sizes, allocated and freed
+    # over and over
+    rng = random.Random(seed)
+    hot = [24, 40, 120, 264, 600, 1500]
+    t = Trace()
+    slots = [None] * 400
+    for i in range(requests):
+        j = rng.randrange(len(slots))
+        if slots[j] is None:
+            slots[j] = t.alloc(rng.choice(hot))
+        else:
+            t.free(slots[j])
+            slots[j] = None
+    t.free_all()
+    return t
+
+
+def phases(seed, rounds):
+    # a program that builds structures of small nodes in phases,
+    # throws most of each phase away, and keeps a few long-lived
+    # blocks and growing buffers around
+    rng = random.Random(seed)
+    t = Trace()
+    keep = []
+    buffers = [t.alloc(64) for i in range(8)]
+    for r in range(rounds):
+        phase = []
+        for i in range(rng.randrange(200, 600)):
+            size = int(rng.lognormvariate(4.0, 1.0)) + 1
+            phase.append(t.alloc(min(size, 16384)))
+            if rng.random() < 0.05:
+                b = rng.randrange(len(buffers))
+                t.realloc(buffers[b], t.live[buffers[b]] * 3 // 2 + 16)
+        if rng.random() < 0.5:
+            phase.reverse()
+        for block in phase:
+            if rng.random() < 0.03:
+                keep.append(block)
+            else:
+                t.free(block)
+        while len(keep) > 300:
+            t.free(keep.pop(rng.randrange(len(keep))))
+        for b in range(len(buffers)):
+            if t.live[buffers[b]] > 65536:
+                t.realloc(buffers[b], 64)
+    t.free_all()
+    return t
+
+
+def realloc_growth(first, step, small, rounds):
+    # one buffer grows step by step while small blocks are allocated
+    # and freed around it
+    t = Trace()
+    buf = t.alloc(first)
+    size = first
+    prev = t.alloc(small)
+    for i in range(rounds):
+        size += step
+        t.realloc(buf, size)
+        nxt = t.alloc(small)
+        t.free(prev)
+        prev = nxt
+    t.free(prev)
+    t.free(buf)
+    return t
+
+
+def main():
+    short1().write("short1-bal.rep")
+    short2().write("short2-bal.rep")
+    binary(64, 448, 512, 2000).write("binary-bal.rep")
+    binary(16, 112, 128, 2000).write("binary2-bal.rep")
+    coalescing(2400).write("coalescing-bal.rep")
+    random_sizes(1, 5000, 1200,
+                 lambda rng: rng.randrange(1, 32768)).write("random-bal.rep")
+    random_sizes(2, 5000, 1200,
+                 lambda rng: int(2 ** rng.uniform(0, 15))).write("random2-bal.rep")
+    churn(3, 12000).write("churn-bal.rep")
+    phases(4, 24).write("phase-bal.rep")
+    realloc_growth(512, 128, 128, 4800).write("realloc-bal.rep")
+    realloc_growth(4092, 5, 16, 4800).write("realloc2-bal.rep")
+
+
+if __name__ == "__main__":
+    main()